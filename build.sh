@@ -25,9 +25,19 @@ SKETCH_NAME=$(basename "$SCRDIR")
 rm -fR "$SKETCH_DIR"/build
 mkdir -p "$SKETCH_DIR"/build
 
-# Compile and Run Test
-gcc -I ./ test/a_test.c -o "$SKETCH_DIR"/build/a_test.exe
-"$SKETCH_DIR"/build/a_test.exe
+# Compile and Run Tests
+for TEST in "$SKETCH_DIR"/test/*_test.c ; do
+  TEST_NAME=$(basename "$TEST" .c)
+  gcc -I "$SKETCH_DIR" "$TEST" -o "$SKETCH_DIR"/build/"$TEST_NAME".exe
+  "$SKETCH_DIR"/build/"$TEST_NAME".exe
+done
+
+# Flash, RAM and step time of the main configurations, against the baseline
+"$SKETCH_DIR"/test/budget.sh
+
+# Same reports and step cost of the runtime settings and of the compile time
+# configuration; their step time is just reported (BENCH_STRICT=1 to fail on it)
+"$SKETCH_DIR"/test/settings_bench.sh
 
 ## Arduino toolchain installation
 arduino-cli core install arduino:avr
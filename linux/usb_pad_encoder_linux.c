@@ -0,0 +1,458 @@
+
+// Linux host build of the encoder: the switches are the keys of one or more
+// evdev devices (e.g. a generic USB or GPIO keyboard encoder) and the result
+// is a joystick created through uinput.
+//
+// Build:
+//   gcc -O2 -I .. usb_pad_encoder_linux.c -o usb_pad_encoder_linux
+//
+// Usage:
+//   usb_pad_encoder_linux [-g] [-v] [-o OUTPUT] [-m KEY:PIN]... INPUT...
+//
+//   INPUT  evdev device, e.g. /dev/input/by-id/usb-xxx-event-kbd
+//   -o     uinput device (default /dev/uinput); if it is not an uinput device
+//          (e.g. a pipe) the raw events are written to it instead
+//   -g     grab the inputs, so the keys do not reach the other applications
+//   -m     map the key code KEY (see linux/input-event-codes.h) to the encoder
+//          pin PIN (see the Advanced Configuration of usb_pad_encoder.h)
+//   -v     log the encoder activity
+//
+// The events are processed as soon as they arrive, and between them the bridge
+// sleeps until the encoder needs a step. The latency between an input event
+// and the matching output is printed on SIGUSR1 and at exit.
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+
+#define USB_PAD_ENCODER_CUSTOM_CONFIGURATION
+#define ENABLE_FULLSWITCH
+#define AUTOFIRE_MODE      ASSIST
+#define TAP_MAX_PERIOD     (200000)
+#define AUTOFIRE_PERIOD    (75000)
+#define AUTOFIRE_TAP_COUNT (2)
+#define AUTOFIRE_SELECTOR  select
+#define USE_HAT_FOR_DPAD
+#define DEBOUNCE_PERIOD    (5000)
+
+#include "usb_pad_encoder.h"
+
+// Encoder HAL --------------------------------------------------------------------
+
+#define PIN_COUNT 32
+
+static int verbose = 0;
+
+#define LOG(C, ...) do{ if( verbose && (C)){ fprintf( stderr, "%s:%d ", __FILE__, __LINE__); fprintf( stderr, __VA_ARGS__); fprintf( stderr, "\n");}} while(0)
+
+static int pin_level[ PIN_COUNT];
+
+static unsigned long get_elasped_microsecond(){
+  struct timespec now;
+  clock_gettime( CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000UL + now.tv_nsec / 1000;
+}
+
+// The platform functions that the enabled protocols do not use are inline, so
+// they do not warn
+static inline void delay_microsecond(unsigned long us){
+  struct timespec wait = { us / 1000000, ( us % 1000000) * 1000};
+  nanosleep( &wait, 0);
+}
+
+static void setup_input( uint8_t p, uint8_t d){
+  (void) d;
+  if( p < PIN_COUNT) pin_level[ p] = 1; // pulled up, i.e. released
+}
+
+static inline void setup_output( uint8_t p){
+  (void) p;
+}
+
+static int read_digital( uint8_t p){
+  return p < PIN_COUNT ? pin_level[ p] : 1;
+}
+
+static inline int read_analog( uint8_t p){
+  (void) p;
+  return 0;
+}
+
+static inline void write_digital( uint8_t p, uint8_t v){
+  if( p < PIN_COUNT) pin_level[ p] = v;
+}
+
+static void use_hid_descriptor( const uint8_t* desc, size_t len){
+  (void) desc;
+  LOG( 1, "hid descriptor (size %zu) not used, the joystick is made by uinput", len);
+}
+
+// Defined after the implementation, since it needs gamepad_status_t
+static void send_hid_report( int id, void* data, size_t len);
+
+// Key map ------------------------------------------------------------------------
+
+typedef struct {
+  uint16_t code;
+  uint8_t pin;
+} key_map_t;
+
+// The MAME defaults for the first player
+static key_map_t key_map[ KEY_CNT] = {
+  { KEY_UP,        FULLSWITCH_UP_PIN},
+  { KEY_DOWN,      FULLSWITCH_DOWN_PIN},
+  { KEY_LEFT,      FULLSWITCH_LEFT_PIN},
+  { KEY_RIGHT,     FULLSWITCH_RIGHT_PIN},
+  { KEY_5,         FULLSWITCH_SELECT_PIN},
+  { KEY_1,         FULLSWITCH_COIN_PIN},
+  { KEY_LEFTCTRL,  FULLSWITCH_FIRE_1_PIN},
+  { KEY_LEFTALT,   FULLSWITCH_FIRE_2_PIN},
+  { KEY_SPACE,     FULLSWITCH_FIRE_3_PIN},
+  { KEY_LEFTSHIFT, FULLSWITCH_FIRE_4_PIN},
+  { KEY_Z,         FULLSWITCH_FIRE_5_PIN},
+  { KEY_X,         FULLSWITCH_FIRE_6_PIN},
+  { KEY_C,         FULLSWITCH_FIRE_7_PIN},
+  { KEY_V,         FULLSWITCH_FIRE_8_PIN},
+  { KEY_B,         FULLSWITCH_FIRE_9_PIN},
+  { KEY_N,         FULLSWITCH_FIRE_10_PIN},
+};
+static int key_map_count = 16;
+
+// Indexed by key code, it is filled from key_map at startup
+static uint8_t key_pin[ KEY_CNT];
+
+#ifndef USB_PAD_ENCODER_LINUX_NO_MAIN
+static void key_map_set( uint16_t code, uint8_t pin){
+  for( int k = 0; k < key_map_count; k += 1){
+    if( key_map[ k].code == code){
+      key_map[ k].pin = pin;
+      return;
+    }
+  }
+  if( key_map_count < KEY_CNT) key_map[ key_map_count++] = (key_map_t){ code, pin};
+}
+#endif // USB_PAD_ENCODER_LINUX_NO_MAIN
+
+static void key_map_compile( void){
+  memset( key_pin, 0xff, sizeof( key_pin));
+  for( int k = 0; k < key_map_count; k += 1)
+    if( key_map[ k].code < KEY_CNT && key_map[ k].pin < PIN_COUNT)
+      key_pin[ key_map[ k].code] = key_map[ k].pin;
+}
+
+// Latency statistics -------------------------------------------------------------
+
+static const unsigned long latency_bucket_limit[] = { 50, 100, 250, 500, 1000, 2000};
+#define LATENCY_BUCKETS ( (int)( sizeof( latency_bucket_limit) / sizeof( *latency_bucket_limit)) + 1)
+
+typedef struct {
+  unsigned long count;
+  unsigned long min;   // us
+  unsigned long max;   // us
+  unsigned long long total; // us
+  unsigned long bucket[ LATENCY_BUCKETS];
+} latency_stat_t;
+
+static latency_stat_t latency = { 0};
+
+// Time of the oldest input event not yet reported, 0 if none
+static unsigned long pending_event_time = 0;
+
+static void latency_add( unsigned long us){
+  if( latency.count == 0 || us < latency.min) latency.min = us;
+  if( us > latency.max) latency.max = us;
+  latency.count += 1;
+  latency.total += us;
+  int b = 0;
+  while( b < LATENCY_BUCKETS -1 && us >= latency_bucket_limit[ b]) b += 1;
+  latency.bucket[ b] += 1;
+}
+
+static void latency_print( FILE* out){
+  fprintf( out, "latency: count %lu min %lu avg %lu max %lu us |",
+           latency.count, latency.min,
+           latency.count ? (unsigned long)( latency.total / latency.count) : 0,
+           latency.max);
+  for( int b = 0; b < LATENCY_BUCKETS; b += 1){
+    if( b < LATENCY_BUCKETS -1) fprintf( out, " <%lu:", latency_bucket_limit[ b]);
+    else fprintf( out, " more:");
+    fprintf( out, "%lu", latency.bucket[ b]);
+  }
+  fprintf( out, "\n");
+  fflush( out);
+}
+
+// uinput joystick ----------------------------------------------------------------
+
+static int output_fd = -1;
+
+static const uint16_t joystick_button[] = {
+  BTN_SELECT, BTN_START,
+  BTN_SOUTH, BTN_EAST, BTN_WEST, BTN_NORTH, BTN_TL,
+  BTN_TR, BTN_TL2, BTN_TR2, BTN_THUMBL, BTN_THUMBR,
+#ifndef USE_HAT_FOR_DPAD
+  BTN_DPAD_UP, BTN_DPAD_DOWN, BTN_DPAD_LEFT, BTN_DPAD_RIGHT,
+#endif
+};
+#define JOYSTICK_BUTTONS ( (int)( sizeof( joystick_button) / sizeof( *joystick_button)))
+
+// If the output is not an uinput device the events are just written to it
+static int joystick_create( int fd){
+  if( ioctl( fd, UI_SET_EVBIT, EV_KEY) < 0) return errno == ENOTTY || errno == EINVAL ? 0 : -1;
+  for( int k = 0; k < JOYSTICK_BUTTONS; k += 1) ioctl( fd, UI_SET_KEYBIT, joystick_button[ k]);
+
+#ifdef USE_HAT_FOR_DPAD
+  ioctl( fd, UI_SET_EVBIT, EV_ABS);
+  for( int axis = ABS_HAT0X; axis <= ABS_HAT0Y; axis += 1){
+    struct uinput_abs_setup abs = { 0};
+    abs.code = axis;
+    abs.absinfo.minimum = -1;
+    abs.absinfo.maximum = 1;
+    if( ioctl( fd, UI_ABS_SETUP, &abs) < 0) return -1;
+  }
+#endif // USE_HAT_FOR_DPAD
+
+  struct uinput_setup setup = { 0};
+  setup.id.bustype = BUS_VIRTUAL;
+  setup.id.vendor = 0x1209;
+  setup.id.product = 0x0001;
+  strcpy( setup.name, "usb_pad_encoder");
+  if( ioctl( fd, UI_DEV_SETUP, &setup) < 0) return -1;
+  if( ioctl( fd, UI_DEV_CREATE) < 0) return -1;
+  return 1;
+}
+
+static int emit_count = 0;
+static struct input_event emit_buffer[ 2 * JOYSTICK_BUTTONS + 8];
+
+static void emit( uint16_t type, uint16_t code, int32_t value){
+  struct input_event* ev = emit_buffer + emit_count++;
+  memset( ev, 0, sizeof( *ev));
+  ev->type = type;
+  ev->code = code;
+  ev->value = value;
+}
+
+static void emit_flush( void){
+  if( emit_count == 0) return;
+  emit( EV_SYN, SYN_REPORT, 0);
+  ssize_t size = emit_count * sizeof( *emit_buffer);
+  if( write( output_fd, emit_buffer, size) != size) LOG( 1, "output error: %s", strerror( errno));
+  emit_count = 0;
+}
+
+// Input --------------------------------------------------------------------------
+
+static unsigned long event_time( const struct input_event* ev){
+  return ev->input_event_sec * 1000000UL + ev->input_event_usec;
+}
+
+// It returns 0 when the device is gone
+static int input_read( int fd){
+  struct input_event ev[ 64];
+  for(;;){
+    ssize_t size = read( fd, ev, sizeof( ev));
+    if( size == 0) return 0;
+    if( size < 0) return errno == EAGAIN || errno == EINTR;
+    for( int k = 0; k < size / (ssize_t) sizeof( *ev); k += 1){
+      if( ev[ k].type != EV_KEY || ev[ k].code >= KEY_CNT) continue;
+      uint8_t pin = key_pin[ ev[ k].code];
+      if( pin >= PIN_COUNT || ev[ k].value == 2) continue; // unmapped or autorepeat
+      pin_level[ pin] = !ev[ k].value; // active low
+      if( pending_event_time == 0) pending_event_time = event_time( ev + k);
+    }
+  }
+}
+
+static int input_open( const char* path, int grab){
+  int fd = open( path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if( fd < 0) return -1;
+  // Timestamps must be comparable with get_elasped_microsecond. Pipes (as
+  // used by the tests) do not support the ioctls, so the errors are ignored.
+  int clock = CLOCK_MONOTONIC;
+  ioctl( fd, EVIOCSCLOCKID, &clock);
+  if( grab) ioctl( fd, EVIOCGRAB, 1);
+  return fd;
+}
+
+// Main loop ----------------------------------------------------------------------
+
+static volatile sig_atomic_t bridge_running = 1;
+static volatile sig_atomic_t bridge_print_stats = 0;
+
+static void bridge_step( void){
+  usb_pad_encoder_step();
+  pending_event_time = 0;
+}
+
+// The inputs must be non-blocking. It returns when all the inputs are closed
+// or bridge_running is cleared.
+static int bridge_run( const int* input_fd, int input_count, int out_fd){
+  output_fd = out_fd;
+  key_map_compile();
+  for( int p = 0; p < PIN_COUNT; p += 1) pin_level[ p] = 1;
+
+  int epoll_fd = epoll_create1( EPOLL_CLOEXEC);
+  if( epoll_fd < 0) return -1;
+  for( int k = 0; k < input_count; k += 1){
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = input_fd[ k]};
+    if( epoll_ctl( epoll_fd, EPOLL_CTL_ADD, input_fd[ k], &ev) < 0) return -1;
+  }
+
+  usb_pad_encoder_init();
+
+  int open_count = input_count;
+  while( bridge_running && open_count > 0){
+
+    // Without key changes, the encoder is stepped only when it asks for it,
+    // e.g. for the autofire or at the end of a debounce
+    const long wake = usb_pad_encoder_wake_delay();
+    const int timeout = wake < 0 ? -1 : (int)(( wake + 999) / 1000);
+    struct epoll_event ready[ 16];
+    int n = epoll_wait( epoll_fd, ready, 16, timeout);
+    if( n < 0 && errno != EINTR) break;
+
+    for( int k = 0; k < n; k += 1){
+      if( !input_read( ready[ k].data.fd)){
+        epoll_ctl( epoll_fd, EPOLL_CTL_DEL, ready[ k].data.fd, 0);
+        open_count -= 1;
+      }
+    }
+    bridge_step();
+
+    if( bridge_print_stats){
+      bridge_print_stats = 0;
+      latency_print( stderr);
+    }
+  }
+
+  close( epoll_fd);
+  return 0;
+}
+
+#ifndef USB_PAD_ENCODER_LINUX_NO_MAIN
+static void on_stop_signal( int sig){
+  (void) sig;
+  bridge_running = 0;
+}
+
+static void on_stats_signal( int sig){
+  (void) sig;
+  bridge_print_stats = 1;
+}
+
+int main( int argc, char* argv[]){
+  const char* output = "/dev/uinput";
+  int grab = 0;
+  int opt;
+
+  while(( opt = getopt( argc, argv, "gvo:m:")) != -1){
+    unsigned code, pin;
+    switch( opt){
+      case 'g': grab = 1; break;
+      case 'v': verbose = 1; break;
+      case 'o': output = optarg; break;
+      case 'm':
+        if( sscanf( optarg, "%u:%u", &code, &pin) != 2 || code >= KEY_CNT || pin >= PIN_COUNT){
+          fprintf( stderr, "wrong key map '%s'\n", optarg);
+          return 1;
+        }
+        key_map_set( code, pin);
+        break;
+      default:
+        fprintf( stderr, "usage: %s [-g] [-v] [-o OUTPUT] [-m KEY:PIN]... INPUT...\n", argv[ 0]);
+        return 1;
+    }
+  }
+  if( optind >= argc){
+    fprintf( stderr, "no input device\n");
+    return 1;
+  }
+
+  int input_count = argc - optind;
+  int input_fd[ input_count];
+  for( int k = 0; k < input_count; k += 1){
+    input_fd[ k] = input_open( argv[ optind + k], grab);
+    if( input_fd[ k] < 0){
+      fprintf( stderr, "can not open %s: %s\n", argv[ optind + k], strerror( errno));
+      return 1;
+    }
+  }
+
+  int out_fd = open( output, O_WRONLY | O_CLOEXEC);
+  if( out_fd < 0 || joystick_create( out_fd) < 0){
+    fprintf( stderr, "can not create the joystick on %s: %s\n", output, strerror( errno));
+    return 1;
+  }
+
+  signal( SIGINT, on_stop_signal);
+  signal( SIGTERM, on_stop_signal);
+  signal( SIGUSR1, on_stats_signal);
+
+  bridge_run( input_fd, input_count, out_fd);
+
+  latency_print( stderr);
+  ioctl( out_fd, UI_DEV_DESTROY);
+  close( out_fd);
+  return 0;
+}
+#endif // USB_PAD_ENCODER_LINUX_NO_MAIN
+
+#define INCLUDE_IMPLEMENTATION
+#include "usb_pad_encoder.h"
+
+// It needs gamepad_status_t, so it comes after the implementation
+static void send_hid_report( int id, void* data, size_t len){
+  static gamepad_status_t old = { 0};
+  static int first = 1;
+  gamepad_status_t* status = (gamepad_status_t*) data;
+  (void) id;
+  (void) len;
+
+  const int button[ JOYSTICK_BUTTONS] = {
+    status->select, status->start,
+    status->fire1, status->fire2, status->fire3, status->fire4, status->fire5,
+    status->fire6, status->fire7, status->fire8, status->fire9, status->fire10,
+#ifndef USE_HAT_FOR_DPAD
+    status->up, status->down, status->left, status->right,
+#endif
+  };
+  const int old_button[ JOYSTICK_BUTTONS] = {
+    old.select, old.start,
+    old.fire1, old.fire2, old.fire3, old.fire4, old.fire5,
+    old.fire6, old.fire7, old.fire8, old.fire9, old.fire10,
+#ifndef USE_HAT_FOR_DPAD
+    old.up, old.down, old.left, old.right,
+#endif
+  };
+  for( int k = 0; k < JOYSTICK_BUTTONS; k += 1)
+    if( first || button[ k] != old_button[ k]) emit( EV_KEY, joystick_button[ k], button[ k]);
+
+#ifdef USE_HAT_FOR_DPAD
+  // direction: 0 = center, 1 = up, then clockwise up to 8 = up-left
+  static const int8_t hat_x[ 9] = { 0, 0, 1, 1, 1, 0, -1, -1, -1};
+  static const int8_t hat_y[ 9] = { 0, -1, -1, 0, 1, 1, 1, 0, -1};
+  if( first || status->direction != old.direction){
+    emit( EV_ABS, ABS_HAT0X, hat_x[ status->direction]);
+    emit( EV_ABS, ABS_HAT0Y, hat_y[ status->direction]);
+  }
+#endif // USE_HAT_FOR_DPAD
+
+  emit_flush();
+  if( pending_event_time) latency_add( get_elasped_microsecond() - pending_event_time);
+  old = *status;
+  first = 0;
+}
@@ -0,0 +1,137 @@
+
+// Simulation used by budget.sh: it drives the encoder of budget_encoder.c with
+// a fixed random input, and it prints the size of the report, the longest I/O
+// time of a step, in us, and the largest and the mean number of basic blocks
+// run by a step.
+//
+// The I/O time is simulated: every platform function costs about what it
+// takes on a 16 MHz AVR, and the waits of the protocols are counted as they
+// are. So the result is the same on every host. The computation between the
+// calls is not part of it.
+//
+// The computation is measured by the basic blocks: budget.sh builds the
+// encoder with -fsanitize-coverage=trace-pc, so the compiler calls
+// __sanitizer_cov_trace_pc at the start of each block it runs. The count does
+// not depend on the host load, only on the code and on the compiler version.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// Only the function declarations are needed, the configuration is the one of
+// budget_encoder.c
+#define USB_PAD_ENCODER_CUSTOM_CONFIGURATION
+#include "usb_pad_encoder.h"
+
+#define COST_READ_DIGITAL_NS   250    // port register access
+#define COST_WRITE_DIGITAL_NS  500    // port register access, with interrupts off
+#define COST_READ_ANALOG_NS    112000 // analogRead, 13 ADC cycles at 125 kHz
+#define COST_REPORT_NS         10000  // HID().SendReport, without the host wait
+#define COST_REPORT_BYTE_NS    1000
+#define COST_STORAGE_WRITE_NS  2000   // EEPROM write start, the end is not waited
+
+#define PIN_COUNT 32
+#define STEPS     200000
+
+static int pin_level[ PIN_COUNT];
+static int analog_level[ PIN_COUNT];
+static unsigned long elapsed_ns = 0;
+static size_t report_size = 0;
+static unsigned long block_count = 0;
+
+void __sanitizer_cov_trace_pc( void){
+  block_count += 1;
+}
+
+void setup_input( uint8_t p, uint8_t d){
+}
+
+void setup_output( uint8_t p){
+}
+
+unsigned long get_elasped_microsecond( void){
+  return elapsed_ns / 1000;
+}
+
+void delay_microsecond( unsigned long us){
+  elapsed_ns += us * 1000;
+}
+
+int read_digital( uint8_t p){
+  elapsed_ns += COST_READ_DIGITAL_NS;
+  return pin_level[ p % PIN_COUNT];
+}
+
+int read_analog( uint8_t p){
+  elapsed_ns += COST_READ_ANALOG_NS;
+  return analog_level[ p % PIN_COUNT];
+}
+
+void write_digital( uint8_t p, uint8_t v){
+  elapsed_ns += COST_WRITE_DIGITAL_NS;
+  pin_level[ p % PIN_COUNT] = v;
+}
+
+void storage_read( uint16_t address, void* data, uint16_t size){
+  for( uint16_t k = 0; k < size; k += 1) ( (uint8_t*) data)[ k] = 0xff;
+}
+
+void storage_write( uint16_t address, const void* data, uint16_t size){
+  elapsed_ns += size * COST_STORAGE_WRITE_NS;
+}
+
+void use_hid_descriptor( const uint8_t* desc, size_t len){
+}
+
+void send_hid_report( int id, void* data, size_t len){
+  elapsed_ns += COST_REPORT_NS + len * COST_REPORT_BYTE_NS;
+  if( len > report_size) report_size = len;
+}
+
+static unsigned long random_state = 42;
+static unsigned long random_next( unsigned long max){
+  random_state = random_state * 1103515245 + 12345;
+  return ( random_state >> 8) % max;
+}
+
+// Presses, fast taps (for the autofire), all the pins together and paddle
+// moves; all the pins are driven, also the ones of the disabled protocols
+static void drive_input( void){
+  switch( random_next( 256)){
+    case 0: case 1: case 2: case 3:
+      pin_level[ random_next( PIN_COUNT)] ^= 1;
+      break;
+    case 4:
+      for( int k = 0; k < PIN_COUNT; k += 1) pin_level[ k] = 0;
+      break;
+    case 5:
+      for( int k = 0; k < PIN_COUNT; k += 1) pin_level[ k] = 1;
+      break;
+    case 6:
+      analog_level[ random_next( PIN_COUNT)] = random_next( 1024);
+      break;
+  }
+}
+
+int main(){
+  for( int k = 0; k < PIN_COUNT; k += 1) pin_level[ k] = 1;
+  elapsed_ns = 1000;
+  usb_pad_encoder_init();
+
+  unsigned long worst_ns = 0;
+  unsigned long worst_blocks = 0;
+  block_count = 0;
+  for( long step = 0; step < STEPS; step += 1){
+    elapsed_ns += 50000 + random_next( 100000);
+    drive_input();
+    unsigned long start = elapsed_ns;
+    unsigned long blocks = block_count;
+    usb_pad_encoder_step();
+    if( elapsed_ns - start > worst_ns) worst_ns = elapsed_ns - start;
+    if( block_count - blocks > worst_blocks) worst_blocks = block_count - blocks;
+  }
+
+  printf( "%zu %lu %lu %lu\n", report_size, ( worst_ns + 999) / 1000,
+    worst_blocks, ( block_count + STEPS / 2) / STEPS);
+  return 0;
+}
@@ -0,0 +1,119 @@
+#!/bin/sh
+
+# Cost of every combination of the main configuration options:
+# - flash and static RAM of the encoder, built for the host and, when avr-gcc
+#   is installed, for the ATmega32u4 of the Arduino Micro
+# - size of the HID report
+# - longest simulated I/O time of a step, in us (see budget.c): only the
+#   platform calls and the protocol waits are counted, not the computation
+# - largest and mean number of basic blocks run by a step on the host (see
+#   budget.c): the computation, counted in a deterministic way
+#
+# The results are compared with budget_baseline.txt, and the script fails if
+# some of them grew more than BUDGET_THRESHOLD percent (default 5). The
+# baseline is rewritten with:
+#   test/budget.sh --update
+# e.g. after an accepted growth.
+#
+# The sizes and the block counts depend on the compiler version, that is
+# recorded in the baseline: with a different gcc (or avr-gcc) the metrics of
+# that compiler are not checked, and the script says so. The AVR metrics are
+# not checked at all without avr-gcc, and the step time is never measured on
+# the AVR itself.
+
+TESTDIR=$(readlink -f $(dirname "$0"))
+ROOTDIR=$(dirname "$TESTDIR")
+BASELINE="$TESTDIR/budget_baseline.txt"
+THRESHOLD=${BUDGET_THRESHOLD:-5}
+
+set -e # automatic exit on error
+
+WORKDIR=$(mktemp -d)
+trap 'rm -fR "$WORKDIR"' EXIT
+RESULT="$WORKDIR/result.txt"
+
+HAS_AVR=0
+AVR_VERSION=-
+if command -v avr-gcc > /dev/null && command -v avr-size > /dev/null; then
+  HAS_AVR=1
+  AVR_VERSION=$(avr-gcc -dumpfullversion)
+fi
+HOST_VERSION=$(gcc -dumpfullversion)
+
+# text, data + bss
+object_size(){
+  "$1" "$2" | awk 'NR == 2 { print $1, $2 + $3 }'
+}
+
+echo "# config host_flash host_ram avr_flash avr_ram report_bytes step_io_us step_blocks mean_blocks" > "$RESULT"
+echo "# compiler $HOST_VERSION $AVR_VERSION" >> "$RESULT"
+for SNES in 0 1; do
+for PADDLE in 0 1; do
+for HAT in 0 1; do
+for AUTOFIRE in NONE ASSIST TOGGLE; do
+  NAME="snes$SNES-paddle$PADDLE-hat$HAT-$AUTOFIRE"
+  FLAGS="-DAUTOFIRE_MODE=$AUTOFIRE"
+  if [ $SNES = 1 ]; then FLAGS="$FLAGS -DENABLE_SNES"; fi
+  if [ $PADDLE = 1 ]; then FLAGS="$FLAGS -DENABLE_ATARI_PADDLE"; fi
+  if [ $HAT = 1 ]; then FLAGS="$FLAGS -DUSE_HAT_FOR_DPAD"; fi
+
+  gcc -Os -I "$ROOTDIR" $FLAGS -c "$TESTDIR/budget_encoder.c" -o "$WORKDIR/encoder.o"
+  HOST=$(object_size size "$WORKDIR/encoder.o")
+  gcc -Os -I "$ROOTDIR" $FLAGS -fsanitize-coverage=trace-pc -c "$TESTDIR/budget_encoder.c" -o "$WORKDIR/encoder_blocks.o"
+  gcc -Os -I "$ROOTDIR" $FLAGS "$TESTDIR/budget.c" "$WORKDIR/encoder_blocks.o" -o "$WORKDIR/budget"
+  SIMULATION=$("$WORKDIR/budget")
+
+  AVR="- -"
+  if [ $HAS_AVR = 1 ]; then
+    avr-gcc -mmcu=atmega32u4 -DF_CPU=16000000UL -Os -I "$ROOTDIR" $FLAGS -c "$TESTDIR/budget_encoder.c" -o "$WORKDIR/encoder_avr.o"
+    AVR=$(object_size avr-size "$WORKDIR/encoder_avr.o")
+  fi
+
+  echo "$NAME $HOST $AVR $SIMULATION" >> "$RESULT"
+done
+done
+done
+done
+
+if [ "$1" = "--update" ]; then
+  cp "$RESULT" "$BASELINE"
+  cat "$BASELINE"
+  exit 0
+fi
+
+# The metrics missing on one side (e.g. no avr-gcc), or measured with another
+# compiler version, are skipped
+awk -v threshold="$THRESHOLD" '
+  $1 == "#" && $2 == "config" { for( k = 2; k < NF; k += 1) metric[ k] = $( k + 1); next }
+  $1 == "#" && $2 == "compiler" && NR == FNR { base_host = $3; base_avr = $4; next }
+  $1 == "#" && $2 == "compiler" {
+    if( $3 != base_host){
+      print "gcc " $3 " instead of " base_host ": host sizes and blocks not checked"
+      skip_host = 1
+    }
+    if( $4 == "-") print "no avr-gcc: AVR sizes not checked"
+    else if( $4 != base_avr){
+      print "avr-gcc " $4 " instead of " base_avr ": AVR sizes not checked"
+      skip_avr = 1
+    }
+    next
+  }
+  $1 == "#" { next }
+  NR == FNR { for( k = 2; k <= NF; k += 1) base[ $1, k] = $k; known[ $1] = 1; next }
+  {
+    line = $0
+    if( !known[ $1]){ line = line "  (new)" }
+    for( k = 2; k <= NF; k += 1){
+      old = base[ $1, k]
+      if( !known[ $1] || old == "-" || $k == "-") continue
+      if( skip_host && metric[ k] ~ /^host_|_blocks$/) continue
+      if( skip_avr && metric[ k] ~ /^avr_/) continue
+      if( $k > old * ( 1 + threshold / 100)){
+        line = line "  " metric[ k] ": " old " -> " $k
+        failed = 1
+      }
+    }
+    print line
+  }
+  END { if( failed){ print "budget exceeded (threshold " threshold "%)"; exit 1 } }
+' "$BASELINE" "$RESULT"
@@ -0,0 +1,42 @@
+
+// The encoder alone, built by budget.sh to measure its flash and RAM size. The
+// options under test come from the command line (-D), the other ones are set
+// here; the platform functions are left to the linker, so they are not counted.
+
+#define USB_PAD_ENCODER_CUSTOM_CONFIGURATION
+#define ENABLE_FULLSWITCH
+#ifndef AUTOFIRE_MODE
+#define AUTOFIRE_MODE        ASSIST
+#endif
+#define TAP_MAX_PERIOD       (200000)
+#define AUTOFIRE_PERIOD      (75000)
+#define AUTOFIRE_TAP_COUNT   (2)
+#define AUTOFIRE_SELECTOR    select
+#define DEBOUNCE_PERIOD      (5000)
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define LOG(C, ...)
+
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#define HID_DESCRIPTOR_ATTRIBUTE PROGMEM
+#endif
+
+void setup_input( uint8_t p, uint8_t d);
+void setup_output( uint8_t p);
+unsigned long get_elasped_microsecond( void);
+void delay_microsecond( unsigned long us);
+int read_digital( uint8_t p);
+int read_analog( uint8_t p);
+void write_digital( uint8_t p, uint8_t v);
+void storage_read( uint16_t address, void* data, uint16_t size);
+void storage_write( uint16_t address, const void* data, uint16_t size);
+void use_hid_descriptor( const uint8_t* desc, size_t len);
+void send_hid_report( int id, void* data, size_t len);
+
+#include "usb_pad_encoder.h"
+
+#define INCLUDE_IMPLEMENTATION
+#include "usb_pad_encoder.h"
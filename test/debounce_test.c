@@ -0,0 +1,153 @@
+
+#define USB_PAD_ENCODER_CUSTOM_CONFIGURATION
+#define ENABLE_FULLSWITCH
+#define AUTOFIRE_MODE        NONE
+#define TAP_MAX_PERIOD       (200000)
+#define AUTOFIRE_PERIOD      (75000)
+#define AUTOFIRE_TAP_COUNT   (2)
+#define AUTOFIRE_SELECTOR    select
+#define DEBOUNCE_PERIOD      (5000)
+#define DEBOUNCE_ADAPTIVE
+#define DEBOUNCE_MIN_PERIOD  (1000)
+#define DEBOUNCE_MAX_PERIOD  (10000)
+#define DEBOUNCE_MARGIN      (500)
+
+#include "test_hal.h"
+#define INCLUDE_IMPLEMENTATION
+#include "usb_pad_encoder.h"
+
+#define GOOD_SWITCH   6 // Fire 1
+#define WORN_SWITCH   7 // Fire 2
+#define BROKEN_SWITCH 8 // Fire 3
+
+typedef struct {
+  uint8_t pin;
+  unsigned long bounce;     // us
+  unsigned long settle_at;  // us
+  unsigned long next_flip;  // us
+  int level;                // settled level
+} switch_model_t;
+
+static switch_model_t model[ 3] = {
+  { FULLSWITCH_FIRE_1_PIN,  300},
+  { FULLSWITCH_FIRE_2_PIN, 4000},
+  { FULLSWITCH_FIRE_3_PIN, 7000},
+};
+
+static unsigned long random_state = 1;
+static unsigned long random_us( unsigned long max){
+  random_state = random_state * 1103515245 + 12345;
+  return 1 + ( random_state >> 8) % max;
+}
+
+static void press( switch_model_t* m, int pressed){
+  m->level = !pressed;
+  m->settle_at = elapsed_us + m->bounce;
+  m->next_flip = elapsed_us;
+}
+
+static void model_update( switch_model_t* m){
+  if( elapsed_us >= m->settle_at){
+    pin_level[ m->pin] = m->level;
+  } else if( elapsed_us >= m->next_flip){
+    pin_level[ m->pin] = !pin_level[ m->pin];
+    m->next_flip = elapsed_us + random_us( 150);
+  }
+}
+
+static int changes_seen[ 3];
+static int last_fire[ 3];
+
+static void run( unsigned long us){
+  for( unsigned long t = 0; t < us; t += 50){
+    elapsed_us += 50;
+    for( int k = 0; k < 3; k += 1) model_update( model + k);
+    usb_pad_encoder_step();
+    if( report_count == 0) continue;
+    gamepad_status_t* report = (gamepad_status_t*) hal_last_report();
+    int fire[ 3] = { report->fire1, report->fire2, report->fire3};
+    for( int k = 0; k < 3; k += 1){
+      if( fire[ k] != last_fire[ k]) changes_seen[ k] += 1;
+      last_fire[ k] = fire[ k];
+    }
+  }
+}
+
+static void tap_all( int times, unsigned long hold){
+  for( int n = 0; n < times; n += 1){
+    for( int k = 0; k < 3; k += 1) press( model + k, 1);
+    run( hold);
+    for( int k = 0; k < 3; k += 1) press( model + k, 0);
+    run( hold);
+  }
+}
+
+int main(){
+  bounce_stat_t stat;
+
+  hal_reset();
+  for( int k = 0; k < 3; k += 1) model[ k].level = 1;
+  elapsed_us = 1;
+  usb_pad_encoder_init();
+  run( 10000);
+  CHECK( usb_pad_encoder_bounce_stat( GOOD_SWITCH, &stat));
+  CHECK( stat.window == DEBOUNCE_PERIOD && stat.changes == 0);
+  CHECK( !usb_pad_encoder_bounce_stat( DEBOUNCE_SLOTS, &stat));
+
+  // Learning
+  tap_all( 5, 50000);
+
+  CHECK( usb_pad_encoder_bounce_stat( GOOD_SWITCH, &stat));
+  CHECK( stat.changes == 10);
+  CHECK( stat.max_bounce <= 300);
+  CHECK( stat.window == DEBOUNCE_MIN_PERIOD);
+
+  CHECK( usb_pad_encoder_bounce_stat( WORN_SWITCH, &stat));
+  CHECK( stat.changes == 10 && stat.bounced == 10);
+  CHECK( stat.max_bounce > 3500 && stat.max_bounce <= 4000);
+  CHECK( stat.window > 4000 && stat.window <= 4000 + DEBOUNCE_MARGIN);
+
+  // The initial window was too short for it, but its bounce was measured anyway
+  CHECK( usb_pad_encoder_bounce_stat( BROKEN_SWITCH, &stat));
+  CHECK( stat.max_bounce > 6500 && stat.max_bounce <= 7000);
+  CHECK( stat.window > 6500 && stat.window <= 7000 + DEBOUNCE_MARGIN);
+
+  // After learning, no spurious press/release
+  for( int k = 0; k < 3; k += 1) changes_seen[ k] = 0;
+  tap_all( 20, 30000);
+  CHECK( changes_seen[ 0] == 40);
+  CHECK( changes_seen[ 1] == 40);
+  CHECK( changes_seen[ 2] == 40);
+
+  // A good switch can be tapped much faster than the default window
+  changes_seen[ 0] = 0;
+  for( int n = 0; n < 10; n += 1){
+    press( model + 0, 1);
+    run( 3000);
+    press( model + 0, 0);
+    run( 3000);
+  }
+  CHECK( changes_seen[ 0] == 20);
+  CHECK( usb_pad_encoder_bounce_stat( GOOD_SWITCH, &stat));
+  CHECK( stat.window == DEBOUNCE_MIN_PERIOD && stat.glitches == 0);
+
+  // The broken one leaked some bounce while learning, the worn one never did
+  CHECK( usb_pad_encoder_bounce_stat( BROKEN_SWITCH, &stat));
+  CHECK( stat.glitches > 0);
+  CHECK( usb_pad_encoder_bounce_stat( WORN_SWITCH, &stat));
+  CHECK( stat.glitches == 0);
+
+  // The same statistics in the feature report, 0 for the never sampled ones
+  uint8_t report[ BOUNCE_SWITCHES * sizeof( bounce_stat_t)];
+  CHECK( usb_pad_encoder_get_bounce_report( report, sizeof( report) - 1) == -1);
+  CHECK( usb_pad_encoder_get_bounce_report( report, sizeof( report)) == sizeof( report));
+  for( int k = 0; k < BOUNCE_SWITCHES; k += 1){
+    bounce_stat_t expected;
+    if( !usb_pad_encoder_bounce_stat( k, &expected)) memset( &expected, 0, sizeof( expected));
+    CHECK( memcmp( report + k * sizeof( stat), &expected, sizeof( stat)) == 0);
+  }
+  memcpy( &stat, report + WORN_SWITCH * sizeof( stat), sizeof( stat));
+  CHECK( stat.changes > 0);
+
+  printf("Test succeeded!\n");
+}
@@ -0,0 +1,142 @@
+
+// The same input is given to an encoder that runs all the stages at every step
+// and to one that uses the fast path: the reports sent must be identical.
+
+#define USB_PAD_ENCODER_CUSTOM_CONFIGURATION
+#define ENABLE_FULLSWITCH
+#define ENABLE_ATARI_PADDLE
+#define ENABLE_SPINNER
+#define USE_HAT_FOR_DPAD
+#ifndef AUTOFIRE_MODE
+#define AUTOFIRE_MODE        ASSIST
+#endif
+#define TAP_MAX_PERIOD       (200000)
+#define AUTOFIRE_PERIOD      (75000)
+#define AUTOFIRE_TAP_COUNT   (2)
+#define AUTOFIRE_SELECTOR    select
+#define DEBOUNCE_PERIOD      (5000)
+
+#include "test_hal.h"
+
+static int force_full_step = 0;
+static long skipped_steps = 0;
+static int full_step_forced(void){
+  if( !force_full_step) skipped_steps += 1;
+  return force_full_step;
+}
+#define FORCE_FULL_STEP full_step_forced()
+
+#define INCLUDE_IMPLEMENTATION
+#include "usb_pad_encoder.h"
+
+#define STEPS     400000
+#define MAX_SENT  40000
+
+typedef struct {
+  long step;
+  uint8_t data[ TEST_REPORT_SIZE];
+} sent_t;
+
+typedef struct {
+  long count;
+  long skipped;
+  sent_t sent[ MAX_SENT];
+} stream_t;
+
+static const uint8_t switch_pin[] = {
+  FULLSWITCH_LEFT_PIN, FULLSWITCH_RIGHT_PIN, FULLSWITCH_SELECT_PIN,
+  FULLSWITCH_COIN_PIN, FULLSWITCH_FIRE_3_PIN, FULLSWITCH_FIRE_4_PIN,
+  FULLSWITCH_FIRE_5_PIN,
+  ATARI_PADDLE_FIRST_FIRE_PIN, ATARI_PADDLE_SECOND_FIRE_PIN,
+};
+#define SWITCHES ( sizeof( switch_pin) / sizeof( *switch_pin))
+
+static unsigned long random_state;
+static unsigned long random_next( unsigned long max){
+  random_state = random_state * 1103515245 + 12345;
+  return ( random_state >> 8) % max;
+}
+
+static int tap_left = 0;
+static int tap_pin = 0;
+static unsigned long tap_next = 0;
+
+// Long idle periods with bursts of activity: single presses, long holds,
+// fast taps (to start the autofire), paddle moves and spinner pulses
+static void drive_input(void){
+  if( tap_left > 0){
+    if( elapsed_us >= tap_next){
+      pin_level[ tap_pin] = !pin_level[ tap_pin];
+      tap_left -= 1;
+      tap_next = elapsed_us + 30000 + random_next( 40000);
+    }
+    return;
+  }
+  switch( random_next( 4000)){
+    case 0: case 1: case 2:
+      pin_level[ switch_pin[ random_next( SWITCHES)]] ^= 1;
+      break;
+    case 3:
+      tap_pin = switch_pin[ random_next( SWITCHES)];
+      tap_left = 2 * ( 1 + random_next( 3)) + random_next( 2);
+      tap_next = elapsed_us;
+      break;
+    case 4:
+      analog_level[ ATARI_PADDLE_FIRST_ANGLE_PIN] = random_next( 1024);
+      break;
+    case 5:
+      analog_level[ ATARI_PADDLE_SECOND_ANGLE_PIN] = random_next( 1024);
+      break;
+    case 6:
+      for( int k = random_next( 200); k > 0; k -= 1){
+        hal_set_pin( SPINNER_A_PIN, !pin_level[ SPINNER_A_PIN]);
+        hal_set_pin( SPINNER_B_PIN, pin_level[ SPINNER_A_PIN]);
+      }
+      break;
+  }
+}
+
+static void run( stream_t* stream, int force){
+  hal_reset();
+  random_state = 42;
+  force_full_step = force;
+  skipped_steps = 0;
+  tap_left = 0;
+  elapsed_us = 1;
+  usb_pad_encoder_init();
+  for( long step = 0; step < STEPS; step += 1){
+    elapsed_us += 50 + random_next( 100);
+    drive_input();
+    int count = report_count;
+    usb_pad_encoder_step();
+    if( report_count == count) continue;
+    CHECK( stream->count < MAX_SENT);
+    stream->sent[ stream->count].step = step;
+    memcpy( stream->sent[ stream->count].data, hal_last_report(), report_size);
+    stream->count += 1;
+  }
+  stream->skipped = skipped_steps;
+}
+
+int main(){
+  // The init resets the whole encoder state, so the runs are independent
+  static stream_t full_stream, fast_stream;
+  stream_t* full = &full_stream;
+  stream_t* fast = &fast_stream;
+  run( full, 1);
+  run( fast, 0);
+
+  CHECK( full->count > 1000);
+  CHECK( full->count == fast->count);
+  for( long k = 0; k < full->count; k += 1){
+    CHECK( full->sent[ k].step == fast->sent[ k].step);
+    CHECK( !memcmp( full->sent[ k].data, fast->sent[ k].data, sizeof( gamepad_status_t)));
+  }
+
+  // Most of the steps are idle
+  CHECK( full->skipped == 0);
+  CHECK( fast->skipped > STEPS / 2);
+
+  printf("reports %ld, skipped steps %ld/%d\n", fast->count, fast->skipped, STEPS);
+  printf("Test succeeded!\n");
+}
@@ -0,0 +1,4 @@
+
+// Same as fast_path_test.c, with the toggle autofire
+#define AUTOFIRE_MODE TOGGLE
+#include "fast_path_test.c"
@@ -0,0 +1,207 @@
+
+// The Mega Drive pads are modeled as the real ones: the outputs follow SELECT
+// after a propagation delay, and the 6 button pad counts the SELECT pulses,
+// resetting the count after 1.5 ms without them.
+
+#define USB_PAD_ENCODER_CUSTOM_CONFIGURATION
+#define ENABLE_FULLSWITCH
+#define ENABLE_GENESIS
+#define USE_HAT_FOR_DPAD
+#define AUTOFIRE_MODE        NONE
+#define TAP_MAX_PERIOD       (200000)
+#define AUTOFIRE_PERIOD      (75000)
+#define AUTOFIRE_TAP_COUNT   (2)
+#define AUTOFIRE_SELECTOR    select
+#define DEBOUNCE_PERIOD      (5000)
+
+#include "test_hal.h"
+#include "usb_pad_encoder.h"
+
+#define PAD_NONE          0
+#define PAD_MASTER_SYSTEM 1
+#define PAD_3_BUTTON      2
+#define PAD_6_BUTTON      3
+
+#define SELECT_PIN FULLSWITCH_FIRE_3_PIN
+#define DELAY_US   1     // from SELECT to the outputs
+#define RESET_US   1500  // of the pulse count
+
+enum { UP, DOWN, LEFT, RIGHT, A, B, C, X, Y, Z, MODE, START, BUTTONS};
+
+static const uint8_t out_pin[ 6] = {
+  FULLSWITCH_UP_PIN, FULLSWITCH_DOWN_PIN, FULLSWITCH_LEFT_PIN,
+  FULLSWITCH_RIGHT_PIN, FULLSWITCH_FIRE_1_PIN, FULLSWITCH_FIRE_2_PIN,
+};
+
+typedef struct {
+  int type;
+  int pressed[ BUTTONS];
+  int select;
+  int count;              // SELECT falling edges since the reset
+  unsigned long last_edge;
+  unsigned long settle_at;
+  int early_reads;        // before the outputs were settled
+  int sequences;          // started after the reset of the count
+  int desync;             // pulses after the 4th one, without a reset
+} pad_t;
+
+static pad_t pad;
+
+static int level( int button){ return !pad.pressed[ button];}
+
+// The levels of U, D, L, R, TL, TR
+static void pad_outputs( int* out){
+  if( pad.type == PAD_NONE){
+    for( int k = 0; k < 6; k += 1) out[ k] = 1;
+    return;
+  }
+  if( pad.type == PAD_MASTER_SYSTEM){
+    int sms[ 6] = { level( UP), level( DOWN), level( LEFT), level( RIGHT), level( A), level( B)};
+    memcpy( out, sms, sizeof( sms));
+    return;
+  }
+  int six = pad.type == PAD_6_BUTTON;
+  if( pad.select){
+    if( six && pad.count == 3){
+      int o[ 6] = { level( Z), level( Y), level( X), level( MODE), level( B), level( C)};
+      memcpy( out, o, sizeof( o));
+    } else {
+      int o[ 6] = { level( UP), level( DOWN), level( LEFT), level( RIGHT), level( B), level( C)};
+      memcpy( out, o, sizeof( o));
+    }
+  } else {
+    if( six && pad.count == 3){
+      int o[ 6] = { 0, 0, 0, 0, level( A), level( START)};
+      memcpy( out, o, sizeof( o));
+    } else if( six && pad.count == 4){
+      int o[ 6] = { 1, 1, 1, 1, level( A), level( START)};
+      memcpy( out, o, sizeof( o));
+    } else {
+      int o[ 6] = { level( UP), level( DOWN), 0, 0, level( A), level( START)};
+      memcpy( out, o, sizeof( o));
+    }
+  }
+}
+
+static void pad_reset( int type){
+  memset( &pad, 0, sizeof( pad));
+  pad.type = type;
+  pad.select = 1;
+}
+
+static void on_write( uint8_t p, uint8_t v){
+  if( p != SELECT_PIN || v == pad.select) return;
+  if( elapsed_us - pad.last_edge > RESET_US){
+    pad.sequences += 1;
+    pad.count = 0;
+  }
+  if( !v) pad.count += 1;
+  if( pad.count > 4) pad.desync += 1;
+  pad.select = v;
+  pad.last_edge = elapsed_us;
+  pad.settle_at = elapsed_us + DELAY_US;
+}
+
+static void on_read( uint8_t p){
+  int out[ 6];
+  for( int k = 0; k < 6; k += 1) if( out_pin[ k] == p){
+    if( elapsed_us < pad.settle_at){
+      pad.early_reads += 1;
+      return;
+    }
+    pad_outputs( out);
+    pin_level[ p] = out[ k];
+  }
+}
+
+#define INCLUDE_IMPLEMENTATION
+#include "usb_pad_encoder.h"
+
+// Test --------------------------------------------------------------------------
+
+static long step_max_us = 0;
+
+static void run( unsigned long us){
+  unsigned long end = elapsed_us + us;
+  while( elapsed_us < end){
+    elapsed_us += 50;
+    unsigned long start = elapsed_us;
+    usb_pad_encoder_step();
+    if( elapsed_us - start > step_max_us) step_max_us = elapsed_us - start;
+  }
+}
+
+static gamepad_status_t* report(void){
+  return (gamepad_status_t*) hal_last_report();
+}
+
+static void press( int button, int pressed){
+  pad.pressed[ button] = pressed;
+}
+
+int main(){
+  hal_reset();
+  on_write_digital = on_write;
+  on_read_digital = on_read;
+  pad_reset( PAD_NONE);
+  elapsed_us = 1;
+  usb_pad_encoder_init();
+  run( 100000);
+  CHECK( report_count <= 1);
+
+  // 3 button
+  pad_reset( PAD_3_BUTTON);
+  press( A, 1);
+  press( C, 1);
+  press( START, 1);
+  press( LEFT, 1);
+  run( 5000);
+  CHECK( report()->fire1 && !report()->fire2 && report()->fire3 && report()->start);
+  CHECK( report()->direction == 7);
+  CHECK( !report()->fire4 && !report()->fire5 && !report()->fire6 && !report()->select);
+  press( A, 0);
+  press( B, 1);
+  press( LEFT, 0);
+  press( DOWN, 1);
+  run( 5000);
+  CHECK( !report()->fire1 && report()->fire2 && report()->direction == 5);
+
+  // 6 button, all pressed
+  pad_reset( PAD_6_BUTTON);
+  for( int k = 0; k < BUTTONS; k += 1) press( k, 1);
+  press( LEFT, 0);
+  press( DOWN, 0);
+  run( 5000);
+  CHECK( report()->fire1 && report()->fire2 && report()->fire3);
+  CHECK( report()->fire4 && report()->fire5 && report()->fire6);
+  CHECK( report()->start && report()->select && report()->direction == 2);
+  for( int k = 0; k < BUTTONS; k += 1) press( k, 0);
+  press( Y, 1);
+  run( 5000);
+  CHECK( report()->fire5 && !report()->fire4 && !report()->fire6 && !report()->fire1);
+  CHECK( report()->direction == 0);
+
+  // The phases: one sequence every GENESIS_READ_PERIOD, always from the reset
+  // of the pad count, with the outputs settled at each read
+  pad.sequences = 0;
+  step_max_us = 0;
+  run( 100000);
+  CHECK( pad.sequences >= 49 && pad.sequences <= 51);
+  CHECK( pad.desync == 0 && pad.early_reads == 0);
+  CHECK( step_max_us <= 20);
+
+  // Master System pad
+  pad_reset( PAD_MASTER_SYSTEM);
+  press( A, 1); // button 1
+  press( UP, 1);
+  run( 5000);
+  CHECK( report()->fire1 && !report()->fire2 && !report()->fire3 && !report()->start);
+  CHECK( report()->direction == 1);
+
+  // Removed
+  pad_reset( PAD_NONE);
+  run( 5000);
+  CHECK( !report()->fire1 && report()->direction == 0);
+
+  printf("Test succeeded!\n");
+}
@@ -0,0 +1,268 @@
+
+// The N64/GameCube pads are modeled at the waveform level: the answer of the
+// pad becomes a sequence of low/high times (with the jitter of real pads), and
+// joybus_transfer measures it as the AVR loop does.
+
+#define USB_PAD_ENCODER_CUSTOM_CONFIGURATION
+#define ENABLE_FULLSWITCH
+#define ENABLE_JOYBUS
+#define ENABLE_SPINNER
+#define USE_HAT_FOR_DPAD
+#define AUTOFIRE_MODE        NONE
+#define TAP_MAX_PERIOD       (200000)
+#define AUTOFIRE_PERIOD      (75000)
+#define AUTOFIRE_TAP_COUNT   (2)
+#define AUTOFIRE_SELECTOR    select
+#define DEBOUNCE_PERIOD      (5000)
+
+#include "test_hal.h"
+#include "usb_pad_encoder.h"
+
+static unsigned long random_state = 1;
+static long random_range( long min, long max){
+  random_state = random_state * 1103515245 + 12345;
+  return min + ( random_state >> 8) % ( max - min + 1);
+}
+
+// Waveform ----------------------------------------------------------------------
+
+#define MAX_EDGES 128
+
+typedef struct {
+  int count;
+  long low_ns[ MAX_EDGES];
+  long high_ns[ MAX_EDGES]; // after the low part
+} waveform_t;
+
+// Bit timing of the pad: the period and the low times can be off by some
+// hundred of ns
+static long bit_period_ns = 4000;
+static long jitter_ns = 0;
+
+static void waveform_bit( waveform_t* w, long low_ns){
+  CHECK( w->count < MAX_EDGES);
+  low_ns += random_range( -jitter_ns, jitter_ns);
+  w->low_ns[ w->count] = low_ns;
+  w->high_ns[ w->count] = bit_period_ns - low_ns;
+  w->count += 1;
+}
+
+static void waveform_from_bytes( waveform_t* w, const uint8_t* data, int len){
+  w->count = 0;
+  for( int k = 0; k < len; k += 1)
+    for( int b = 7; b >= 0; b -= 1)
+      waveform_bit( w, ( data[ k] >> b & 1) ? bit_period_ns / 4 : bit_period_ns * 3 / 4);
+  waveform_bit( w, bit_period_ns / 2); // stop bit
+}
+
+// Measure the waveform as the AVR loop: it looks at the line every 500 ns, and
+// it counts the samples while the line is low. It returns the duration in ns.
+static long waveform_capture( const waveform_t* w, long answer_delay_ns, uint8_t* low_time, uint8_t max_bits, int* bits){
+  long duration = 0;
+  long timeout = 32000;
+  long wait = answer_delay_ns;
+  *bits = 0;
+  for( int k = 0; k < w->count && *bits < max_bits; k += 1){
+    if( wait > timeout) break;
+    long phase = random_range( 0, 499); // of the sampling, from the edge
+    long count = ( w->low_ns[ k] + phase) / 500;
+    if( count < 1) count = 1;
+    low_time[ *bits] = count;
+    *bits += 1;
+    duration += wait + w->low_ns[ k];
+    wait = w->high_ns[ k];
+    timeout = 8000;
+  }
+  if( *bits < max_bits) duration += timeout;
+  return duration;
+}
+
+// Pad model ---------------------------------------------------------------------
+
+#define PAD_NONE     0
+#define PAD_N64      1
+#define PAD_GAMECUBE 2
+
+static int pad_type = PAD_NONE;
+static uint8_t pad_state[ 8];   // answer to the poll
+static int pad_truncate = 0;    // next answers to cut
+static int transfer_count = 0;
+static long transfer_max_us = 0;
+
+static uint8_t joybus_transfer( uint8_t pin, const uint8_t* request, uint8_t request_len, uint8_t* low_time, uint8_t max_bits){
+  CHECK( pin == FULLSWITCH_FIRE_6_PIN);
+  transfer_count += 1;
+
+  uint8_t answer[ 8];
+  int len = 0;
+  if( pad_type != PAD_NONE && request_len == 1 && request[ 0] == 0x00){
+    answer[ 0] = pad_type == PAD_N64 ? 0x05 : 0x09;
+    answer[ 1] = 0x00;
+    answer[ 2] = 0x02;
+    len = 3;
+  }
+  if( pad_type == PAD_N64 && request_len == 1 && request[ 0] == 0x01){
+    memcpy( answer, pad_state, 4);
+    len = 4;
+  }
+  if( pad_type == PAD_GAMECUBE && request_len == 3 && request[ 0] == 0x40 && request[ 1] == 0x03){
+    memcpy( answer, pad_state, 8);
+    len = 8;
+  }
+
+  waveform_t w;
+  waveform_from_bytes( &w, answer, len);
+  if( len == 0) w.count = 0;
+  if( pad_truncate > 0 && len > 0){
+    pad_truncate -= 1;
+    w.count = random_range( 1, w.count -1);
+  }
+
+  int bits;
+  long ns = ( request_len * 8 +1) * 4000;
+  ns += waveform_capture( &w, random_range( 2000, 4000), low_time, max_bits, &bits);
+  long us = ns / 1000 +1;
+  elapsed_us += us;
+  if( us > transfer_max_us) transfer_max_us = us;
+  return bits;
+}
+
+#define INCLUDE_IMPLEMENTATION
+#include "usb_pad_encoder.h"
+#include "test_descriptor.h"
+
+// Test --------------------------------------------------------------------------
+
+static long step_max_us = 0;
+
+static void run( unsigned long us){
+  unsigned long end = elapsed_us + us;
+  while( elapsed_us < end){
+    elapsed_us += 100;
+    unsigned long start = elapsed_us;
+    usb_pad_encoder_step();
+    if( elapsed_us - start > step_max_us) step_max_us = elapsed_us - start;
+  }
+}
+
+static gamepad_status_t* report(void){
+  return (gamepad_status_t*) hal_last_report();
+}
+
+static void check_decoder(void){
+  // Random answers at the slowest and fastest pads, with a lot of jitter
+  long period[] = { 3600, 4000, 4400};
+  for( int p = 0; p < 3; p += 1){
+    bit_period_ns = period[ p];
+    jitter_ns = 250;
+    for( int n = 0; n < 1000; n += 1){
+      uint8_t data[ 8], decoded[ 8];
+      for( int k = 0; k < 8; k += 1) data[ k] = random_range( 0, 255);
+      waveform_t w;
+      waveform_from_bytes( &w, data, 8);
+      uint8_t low_time[ 65];
+      int bits;
+      waveform_capture( &w, 3000, low_time, 65, &bits);
+      CHECK( bits == 65);
+      CHECK( joybus_decode( low_time, bits, decoded, 8));
+      CHECK( !memcmp( data, decoded, 8));
+    }
+  }
+  bit_period_ns = 4000;
+  jitter_ns = 0;
+
+  // The low times of a N64 answer: A + Start, stick right/down
+  static const uint8_t recorded[] = {
+    2, 6, 6, 2, 6, 6, 6, 6,  6, 6, 6, 6, 6, 6, 6, 6,
+    6, 6, 2, 6, 6, 6, 6, 6,  2, 2, 2, 2, 2, 6, 2, 2,
+    4,
+  };
+  uint8_t decoded[ 4];
+  CHECK( joybus_decode( recorded, sizeof( recorded), decoded, 4));
+  CHECK( decoded[ 0] == 0x90 && decoded[ 1] == 0x00);
+  CHECK( decoded[ 2] == 0x20 && (int8_t) decoded[ 3] == -5);
+
+  // Missing bits
+  CHECK( !joybus_decode( recorded, sizeof( recorded) -1, decoded, 4));
+}
+
+int main(){
+  check_gamepad_layout();
+  check_decoder();
+
+  hal_reset();
+  elapsed_us = 1;
+  usb_pad_encoder_init();
+
+  // No pad: a short identify request every JOYBUS_DETECT_PERIOD
+  transfer_count = 0;
+  run( 1000000);
+  CHECK( transfer_count >= 9 && transfer_count <= 11);
+  CHECK( transfer_max_us < 100);
+
+  // N64
+  jitter_ns = 200;
+  pad_type = PAD_N64;
+  pad_state[ 0] = 0x80 | 0x10 | 0x08; // A, Start, Up
+  pad_state[ 1] = 0x20 | 0x08 | 0x01; // L, C up, C right
+  pad_state[ 2] = 85;
+  pad_state[ 3] = (uint8_t) -40;
+  run( JOYBUS_DETECT_PERIOD + 10000);
+  CHECK( report()->fire1 && !report()->fire2 && report()->start);
+  CHECK( report()->fire5 && !report()->fire6 && !report()->fire7);
+  CHECK( report()->direction == 1);
+  CHECK( report()->axis[ 0] > 32000);
+  CHECK( report()->axis[ 1] > 15000 && report()->axis[ 1] < 16000); // down
+  CHECK( report()->axis[ 2] == 32767 && report()->axis[ 3] == -32767);
+  CHECK( report()->axis[ 4] == 32767 && report()->axis[ 5] == -32768);
+
+  // Polled every JOYBUS_POLL_PERIOD, in a bounded time
+  transfer_count = 0;
+  step_max_us = 0;
+  run( 100000);
+  CHECK( transfer_count >= 49 && transfer_count <= 51);
+  CHECK( step_max_us < 200);
+
+  // Some bad answer does not change the state
+  int sent = report_count;
+  pad_truncate = JOYBUS_MAX_FAILURES -1;
+  run( 20000);
+  CHECK( report_count == sent);
+  pad_state[ 0] = 0;
+  run( 10000);
+  CHECK( !report()->fire1 && !report()->start && report()->direction == 0);
+
+  // Removed
+  pad_type = PAD_NONE;
+  run( 10000);
+  CHECK( !report()->fire5 && report()->axis[ 0] == 0 && report()->axis[ 4] == 0);
+
+  // GameCube
+  pad_type = PAD_GAMECUBE;
+  memset( pad_state, 0, 8);
+  pad_state[ 0] = 0x01 | 0x08;        // A, Y
+  pad_state[ 1] = 0x80 | 0x10 | 0x02; // Z, Right
+  pad_state[ 2] = 128;
+  pad_state[ 3] = 255;                // up
+  pad_state[ 4] = 0;                  // C stick left
+  pad_state[ 5] = 128;
+  pad_state[ 6] = 0;
+  pad_state[ 7] = 255;
+  step_max_us = 0;
+  run( JOYBUS_DETECT_PERIOD + 10000);
+  CHECK( report()->fire1 && report()->fire4 && !report()->fire2 && report()->fire7);
+  CHECK( report()->direction == 3);
+  CHECK( report()->axis[ 0] == 0 && report()->axis[ 1] == -32512);
+  CHECK( report()->axis[ 2] == -32768 && report()->axis[ 3] == 0);
+  CHECK( report()->axis[ 4] == -32768 && report()->axis[ 5] == 32767);
+  CHECK( step_max_us < 400);
+
+  // An answer with a wrong constant bit is not accepted
+  pad_state[ 1] &= ~0x80;
+  pad_state[ 0] = 0;
+  run( 3000);
+  CHECK( report()->fire1);
+
+  printf( "longest transfer %ld us\n", transfer_max_us);
+  printf("Test succeeded!\n");
+}
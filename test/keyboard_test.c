@@ -0,0 +1,124 @@
+
+// The keyboard output mode: every switch is a key of the bitmap report, so no
+// key is lost also when all the switches are pressed together.
+
+#define USB_PAD_ENCODER_CUSTOM_CONFIGURATION
+#define ENABLE_FULLSWITCH
+#define OUTPUT_MODE          KEYBOARD
+#define AUTOFIRE_MODE        NONE
+#define TAP_MAX_PERIOD       (200000)
+#define AUTOFIRE_PERIOD      (75000)
+#define AUTOFIRE_TAP_COUNT   (2)
+#define AUTOFIRE_SELECTOR    select
+#define DEBOUNCE_PERIOD      (5000)
+
+#include "test_hal.h"
+
+#define INCLUDE_IMPLEMENTATION
+#include "usb_pad_encoder.h"
+
+// Test --------------------------------------------------------------------------
+
+#define SWITCHES 16
+
+static const uint8_t switch_pin[ SWITCHES] = {
+  FULLSWITCH_UP_PIN, FULLSWITCH_DOWN_PIN, FULLSWITCH_LEFT_PIN, FULLSWITCH_RIGHT_PIN,
+  FULLSWITCH_SELECT_PIN, FULLSWITCH_COIN_PIN,
+  FULLSWITCH_FIRE_1_PIN, FULLSWITCH_FIRE_2_PIN, FULLSWITCH_FIRE_3_PIN,
+  FULLSWITCH_FIRE_4_PIN, FULLSWITCH_FIRE_5_PIN, FULLSWITCH_FIRE_6_PIN,
+  FULLSWITCH_FIRE_7_PIN, FULLSWITCH_FIRE_8_PIN, FULLSWITCH_FIRE_9_PIN,
+  FULLSWITCH_FIRE_10_PIN,
+};
+
+// The default MAME layout
+static const uint8_t switch_key[ SWITCHES] = {
+  0x52, 0x51, 0x50, 0x4f, // arrows
+  0x22, 0x1e,             // 5, 1
+  0xe0, 0xe2, 0x2c,       // Left Ctrl, Left Alt, Space
+  0xe1, 0x1d, 0x1b,       // Left Shift, Z, X
+  0x06, 0x19, 0x05,       // C, V, B
+  0x11,                   // N
+};
+
+static int key_pressed( const uint8_t* report, uint8_t key){
+  if( key >= 0xe0) return report[ 0] >> ( key & 7) & 1;
+  return report[ 1 + key / 8] >> ( key % 8) & 1;
+}
+
+static int key_count( const uint8_t* report){
+  int count = 0;
+  for( size_t k = 0; k < KEYBOARD_REPORT_SIZE; k += 1)
+    for( int b = 0; b < 8; b += 1) count += report[ k] >> b & 1;
+  return count;
+}
+
+static void run( unsigned long us){
+  unsigned long end = elapsed_us + us;
+  while( elapsed_us < end){
+    elapsed_us += 100;
+    usb_pad_encoder_step();
+  }
+}
+
+// The last report has exactly the keys of the pressed switches
+static void check_keys( const int* pressed){
+  const uint8_t* report = hal_last_report();
+  int count = 0;
+  CHECK( report_size == KEYBOARD_REPORT_SIZE);
+  for( int k = 0; k < SWITCHES; k += 1){
+    CHECK( key_pressed( report, switch_key[ k]) == pressed[ k]);
+    count += pressed[ k];
+  }
+  CHECK( key_count( report) == count);
+}
+
+static void press( int* pressed, int k, int value){
+  pressed[ k] = value;
+  hal_set_pin( switch_pin[ k], !value);
+}
+
+int main(){
+  int pressed[ SWITCHES] = { 0};
+
+  hal_reset();
+  elapsed_us = 1;
+  usb_pad_encoder_init();
+  run( 10000);
+  CHECK( report_count == 0);
+
+  // One at a time, until all are pressed: one report for each
+  for( int k = 0; k < SWITCHES; k += 1){
+    int sent = report_count;
+    press( pressed, k, 1);
+    run( 10000);
+    CHECK( report_count == sent +1);
+    check_keys( pressed);
+  }
+  CHECK( key_count( hal_last_report()) == SWITCHES);
+
+  // Nothing is sent while the keys do not change
+  int sent = report_count;
+  run( 100000);
+  CHECK( report_count == sent);
+
+  // All released and pressed together
+  for( int k = 0; k < SWITCHES; k += 1) press( pressed, k, 0);
+  run( 10000);
+  check_keys( pressed);
+  CHECK( key_count( hal_last_report()) == 0);
+  for( int k = 0; k < SWITCHES; k += 1) press( pressed, k, 1);
+  run( 10000);
+  check_keys( pressed);
+
+  // Random sets of switches
+  unsigned long random_state = 1;
+  for( int n = 0; n < 1000; n += 1){
+    random_state = random_state * 1103515245 + 12345;
+    unsigned long bits = random_state >> 8;
+    for( int k = 0; k < SWITCHES; k += 1) press( pressed, k, bits >> k & 1);
+    run( 10000);
+    check_keys( pressed);
+  }
+
+  printf("Test succeeded!\n");
+}
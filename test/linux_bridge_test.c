@@ -0,0 +1,211 @@
+
+// The Linux bridge runs in a child process. The keys come from a virtual
+// keyboard made with uinput, or from a pipe when uinput is not available, and
+// the joystick events are written to a pipe.
+
+#ifndef __linux__
+#include <stdio.h>
+int main(){
+  printf("Test skipped: linux only\n");
+}
+#else // __linux__
+
+#define USB_PAD_ENCODER_LINUX_NO_MAIN
+#include "../linux/usb_pad_encoder_linux.c"
+
+#include <poll.h>
+#include <dirent.h>
+#include <sys/wait.h>
+
+#define CHECK(C) do{ if( !(C)){ printf( "%s:%d check failed: %s\n", __FILE__, __LINE__, #C); exit( 1);}} while(0)
+
+static int source_fd = -1;
+static int source_is_uinput = 0;
+
+// It returns the path of the event device, or 0 if uinput is not available
+static const char* source_create_uinput( void){
+  static char path[ 300];
+  source_fd = open( "/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+  if( source_fd < 0) return 0;
+  ioctl( source_fd, UI_SET_EVBIT, EV_KEY);
+  for( int k = 0; k < key_map_count; k += 1) ioctl( source_fd, UI_SET_KEYBIT, key_map[ k].code);
+  struct uinput_setup setup = { 0};
+  setup.id.bustype = BUS_VIRTUAL;
+  strcpy( setup.name, "usb_pad_encoder test keyboard");
+  char sysname[ 32];
+  if( ioctl( source_fd, UI_DEV_SETUP, &setup) < 0
+   || ioctl( source_fd, UI_DEV_CREATE) < 0
+   || ioctl( source_fd, UI_GET_SYSNAME( sizeof( sysname)), sysname) < 0){
+    close( source_fd);
+    return 0;
+  }
+  char dir_path[ 128];
+  snprintf( dir_path, sizeof( dir_path), "/sys/devices/virtual/input/%s", sysname);
+  for( int retry = 0; retry < 100; retry += 1){
+    DIR* dir = opendir( dir_path);
+    struct dirent* entry;
+    while( dir && ( entry = readdir( dir))){
+      if( strncmp( entry->d_name, "event", 5)) continue;
+      snprintf( path, sizeof( path), "/dev/input/%s", entry->d_name);
+      closedir( dir);
+      if( access( path, R_OK) == 0) return path;
+      dir = 0;
+    }
+    if( dir) closedir( dir);
+    usleep( 10000);
+  }
+  ioctl( source_fd, UI_DEV_DESTROY);
+  close( source_fd);
+  return 0;
+}
+
+static void key( uint16_t code, int value){
+  struct input_event ev[ 2];
+  memset( ev, 0, sizeof( ev));
+  unsigned long now = get_elasped_microsecond();
+  for( int k = 0; k < 2; k += 1){
+    ev[ k].input_event_sec = now / 1000000;
+    ev[ k].input_event_usec = now % 1000000;
+  }
+  ev[ 0].type = EV_KEY;
+  ev[ 0].code = code;
+  ev[ 0].value = value;
+  ev[ 1].type = EV_SYN;
+  ev[ 1].code = SYN_REPORT;
+  CHECK( write( source_fd, ev, sizeof( ev)) == sizeof( ev));
+}
+
+static int joystick_fd = -1;
+static int button_state[ KEY_CNT];
+static int hat_state[ 2];
+
+// Read the joystick until a whole report arrives. It returns the us elapsed
+// from the call, or -1 on timeout.
+static long joystick_wait( int timeout_ms){
+  unsigned long start = get_elasped_microsecond();
+  struct pollfd fd = { joystick_fd, POLLIN, 0};
+  for(;;){
+    if( poll( &fd, 1, timeout_ms) <= 0) return -1;
+    struct input_event ev;
+    CHECK( read( joystick_fd, &ev, sizeof( ev)) == sizeof( ev));
+    if( ev.type == EV_KEY) button_state[ ev.code] = ev.value;
+    if( ev.type == EV_ABS) hat_state[ ev.code - ABS_HAT0X] = ev.value;
+    if( ev.type == EV_SYN) return get_elasped_microsecond() - start;
+  }
+}
+
+static long press_and_wait( uint16_t code, int value){
+  unsigned long start = get_elasped_microsecond();
+  key( code, value);
+  CHECK( joystick_wait( 100) >= 0);
+  return get_elasped_microsecond() - start;
+}
+
+static int compare_long( const void* a, const void* b){
+  return *(const long*) a - *(const long*) b;
+}
+
+int main(){
+  int out_pipe[ 2];
+  int stat_pipe[ 2];
+  CHECK( pipe( out_pipe) == 0);
+  CHECK( pipe( stat_pipe) == 0);
+
+  int input_fd;
+  const char* source_path = source_create_uinput();
+  if( source_path){
+    source_is_uinput = 1;
+    input_fd = input_open( source_path, 1);
+    CHECK( input_fd >= 0);
+  } else {
+    int in_pipe[ 2];
+    CHECK( pipe( in_pipe) == 0);
+    source_fd = in_pipe[ 1];
+    input_fd = in_pipe[ 0];
+    fcntl( input_fd, F_SETFL, O_NONBLOCK);
+  }
+  printf( "source: %s\n", source_is_uinput ? source_path : "pipe");
+  fflush( stdout);
+
+  pid_t pid = fork();
+  CHECK( pid >= 0);
+  if( pid == 0){
+    close( out_pipe[ 0]);
+    close( stat_pipe[ 0]);
+    if( !source_is_uinput) close( source_fd);
+    CHECK( joystick_create( out_pipe[ 1]) >= 0);
+    bridge_run( &input_fd, 1, out_pipe[ 1]);
+    CHECK( write( stat_pipe[ 1], &latency, sizeof( latency)) == sizeof( latency));
+    exit( 0);
+  }
+  close( out_pipe[ 1]);
+  close( stat_pipe[ 1]);
+  close( input_fd);
+  joystick_fd = out_pipe[ 0];
+
+  // Mapping
+  long delay[ 64];
+  int delay_count = 0;
+  delay[ delay_count++] = press_and_wait( KEY_LEFTCTRL, 1);
+  CHECK( button_state[ BTN_SOUTH] == 1);
+  usleep( 20000);
+  delay[ delay_count++] = press_and_wait( KEY_LEFTCTRL, 0);
+  CHECK( button_state[ BTN_SOUTH] == 0);
+  delay[ delay_count++] = press_and_wait( KEY_UP, 1);
+  CHECK( hat_state[ 0] == 0 && hat_state[ 1] == -1);
+  delay[ delay_count++] = press_and_wait( KEY_RIGHT, 1);
+  CHECK( hat_state[ 0] == 1 && hat_state[ 1] == -1);
+  usleep( 20000);
+  delay[ delay_count++] = press_and_wait( KEY_UP, 0);
+  delay[ delay_count++] = press_and_wait( KEY_RIGHT, 0);
+  CHECK( hat_state[ 0] == 0 && hat_state[ 1] == 0);
+  delay[ delay_count++] = press_and_wait( KEY_1, 1);
+  CHECK( button_state[ BTN_START] == 1);
+
+  // A release during the debounce is sent at its end, with no other event
+  delay[ delay_count++] = press_and_wait( KEY_SPACE, 1);
+  CHECK( button_state[ BTN_WEST] == 1);
+  key( KEY_SPACE, 0);
+  CHECK( joystick_wait( 100) >= 0);
+  CHECK( button_state[ BTN_WEST] == 0);
+
+  // Autofire: tap three times and hold, then the bridge must go on alone
+  for( int k = 0; k < 3; k += 1){
+    usleep( 30000);
+    delay[ delay_count++] = press_and_wait( KEY_LEFTALT, 1);
+    usleep( 30000);
+    if( k < 2) delay[ delay_count++] = press_and_wait( KEY_LEFTALT, 0);
+  }
+  int toggles = 0;
+  unsigned long start = get_elasped_microsecond();
+  while( get_elasped_microsecond() - start < 400000) if( joystick_wait( 100) >= 0) toggles += 1;
+  CHECK( toggles >= 4);
+
+  // After the release it stops
+  key( KEY_LEFTALT, 0);
+  usleep( 10000);
+  while( joystick_wait( 10) >= 0);
+  CHECK( button_state[ BTN_EAST] == 0);
+  CHECK( joystick_wait( 200) < 0);
+
+  // Closing the source stops the bridge
+  if( source_is_uinput) ioctl( source_fd, UI_DEV_DESTROY);
+  close( source_fd);
+  latency_stat_t child_latency;
+  CHECK( read( stat_pipe[ 0], &child_latency, sizeof( child_latency)) == sizeof( child_latency));
+  int status = 0;
+  waitpid( pid, &status, 0);
+  CHECK( WIFEXITED( status) && WEXITSTATUS( status) == 0);
+
+  // Latency, as seen by the bridge and from outside
+  latency = child_latency;
+  latency_print( stdout);
+  CHECK( latency.count >= (unsigned long) delay_count);
+  qsort( delay, delay_count, sizeof( *delay), compare_long);
+  printf( "end to end latency: median %ld max %ld us\n", delay[ delay_count / 2], delay[ delay_count -1]);
+  CHECK( delay[ delay_count / 2] < 1000);
+
+  printf("Test succeeded!\n");
+}
+
+#endif // __linux__
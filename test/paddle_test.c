@@ -0,0 +1,167 @@
+
+// The Atari paddles: the range of each one is learned while it is moved, the
+// position is linear also if the ADC reading is not, and the range is saved
+// and loaded again at the next init.
+
+#define USB_PAD_ENCODER_CUSTOM_CONFIGURATION
+#define ENABLE_FULLSWITCH
+#define ENABLE_ATARI_PADDLE
+#define AUTOFIRE_MODE        NONE
+#define TAP_MAX_PERIOD       (200000)
+#define AUTOFIRE_PERIOD      (75000)
+#define AUTOFIRE_TAP_COUNT   (2)
+#define AUTOFIRE_SELECTOR    select
+#define DEBOUNCE_PERIOD      (5000)
+
+#include "test_hal.h"
+
+#define INCLUDE_IMPLEMENTATION
+#include "usb_pad_encoder.h"
+
+// Test --------------------------------------------------------------------------
+
+// A 1 Mohm paddle that uses only a part of its track, read through the pull-up
+#define PULL_UP    35000.0
+#define TRACK_LOW  50000.0
+#define TRACK_HIGH 900000.0
+
+static const uint8_t angle_pin[ 2] = { ATARI_PADDLE_FIRST_ANGLE_PIN, ATARI_PADDLE_SECOND_ANGLE_PIN };
+static const uint8_t fire_pin[ 2] = { ATARI_PADDLE_FIRST_FIRE_PIN, ATARI_PADDLE_SECOND_FIRE_PIN };
+
+// Position from 0 to 1
+static void move( int paddle, double position){
+  double r = TRACK_LOW + position * ( TRACK_HIGH - TRACK_LOW);
+  analog_level[ angle_pin[ paddle]] = (int)( 1023.0 * r / ( r + PULL_UP) + 0.5);
+}
+
+static void run( unsigned long us){
+  unsigned long end = elapsed_us + us;
+  while( elapsed_us < end){
+    elapsed_us += 100;
+    usb_pad_encoder_step();
+  }
+}
+
+static int axis( int paddle){
+  gamepad_status_t status;
+  memcpy( &status, hal_last_report(), sizeof( status));
+  return status.axis[ paddle];
+}
+
+static int expected( double position){
+  return (int)( position * 65535.0) - 32768;
+}
+
+// The exact inverse of the reading, in the range of the sweep
+static int ideal( int raw){
+  double low = TRACK_LOW / ( TRACK_LOW + PULL_UP) * 1023.0 + 0.5;
+  double high = TRACK_HIGH / ( TRACK_HIGH + PULL_UP) * 1023.0 + 0.5;
+  low = (int) low / ( 1024.0 - (int) low);
+  high = (int) high / ( 1024.0 - (int) high);
+  return (int)( ( raw / ( 1024.0 - raw) - low) / ( high - low) * 65535.0) - 32768;
+}
+
+static void sweep( void){
+  for( int k = 0; k <= 100; k += 1){
+    move( 0, k / 100.0);
+    move( 1, 1 - k / 100.0);
+    run( 2000);
+  }
+}
+
+int main(){
+
+  hal_reset();
+  elapsed_us = 1;
+  move( 0, 0.5);
+  move( 1, 0.5);
+  usb_pad_encoder_init();
+  run( 10000);
+
+  // Nothing is saved until the range is stable
+  sweep();
+  CHECK( storage_writes == 0);
+
+  // The full HID range, linear in the position up to the ADC resolution (the
+  // reading is compressed at the end of the track, where an ADC step is some
+  // percent of the range)
+  for( int k = 0; k <= 20; k += 1){
+    double position = k / 20.0;
+    move( 0, position);
+    move( 1, position);
+    run( 2000);
+    for( int p = 0; p < 2; p += 1){
+      // The table error is below an ADC step
+      int raw = analog_level[ angle_pin[ p]];
+      CHECK( abs( axis( p) - ideal( raw)) <= ideal( raw +1) - ideal( raw));
+      CHECK( abs( axis( p) - expected( position)) < 65536 / 20);
+    }
+  }
+  move( 0, 0);
+  move( 1, 1);
+  run( 2000);
+  CHECK( axis( 0) == -32768);
+  CHECK( axis( 1) == 32767);
+
+  // Saved once the range is stable, a byte at a time
+  unsigned long start = elapsed_us;
+  while( storage_writes == 0) run( 1000);
+  CHECK( elapsed_us - start > ATARI_PADDLE_SAVE_DELAY - 500000);
+  CHECK( elapsed_us - start <= ATARI_PADDLE_SAVE_DELAY);
+  CHECK( storage_writes == 1);
+  run( STORAGE_BYTE_WRITE_TIME);
+  CHECK( storage_writes == 2);
+  run( sizeof( paddle_record_t) * STORAGE_BYTE_WRITE_TIME);
+  CHECK( storage_writes == sizeof( paddle_record_t));
+  run( 2 * ATARI_PADDLE_SAVE_DELAY);
+  CHECK( storage_writes == sizeof( paddle_record_t));
+
+  // Loaded at the next init: the full range without a sweep
+  usb_pad_encoder_init();
+  move( 0, 1);
+  move( 1, 0);
+  run( 2000);
+  CHECK( axis( 0) == 32767);
+  CHECK( axis( 1) == -32768);
+  move( 0, 0.25);
+  run( 2000);
+  CHECK( abs( axis( 0) - expected( 0.25)) < 65536 / 50);
+  run( 2 * ATARI_PADDLE_SAVE_DELAY);
+  CHECK( storage_writes == sizeof( paddle_record_t));
+
+  // Holding both the fires at init forgets it, so the range starts again from
+  // the current position
+  hal_set_pin( fire_pin[ 0], 0);
+  hal_set_pin( fire_pin[ 1], 0);
+  move( 0, 0.5);
+  move( 1, 0.5);
+  usb_pad_encoder_init();
+  hal_set_pin( fire_pin[ 0], 1);
+  hal_set_pin( fire_pin[ 1], 1);
+  run( 10000);
+  CHECK( axis( 0) == -32768);
+  CHECK( axis( 1) == -32768);
+  sweep();
+  run( ATARI_PADDLE_SAVE_DELAY + sizeof( paddle_record_t) * STORAGE_BYTE_WRITE_TIME);
+  CHECK( storage_writes == 2 * sizeof( paddle_record_t));
+
+  // A wider range rebuilds the table one entry per step, also if the input
+  // does not change, and meanwhile the value is computed directly
+  const paddle_axis_t* paddle = default_context.paddle.axis + 0;
+  move( 0, 1.05);
+  run( 2000);
+  CHECK( paddle->built <= ATARI_PADDLE_TABLE_SIZE);
+  while( paddle->built <= ATARI_PADDLE_TABLE_SIZE){
+    int built = paddle->built;
+    run( 100);
+    CHECK( paddle->built == built + 1);
+    CHECK( axis( 0) == 32767);
+  }
+  move( 0, 0.5);
+  run( 2000);
+  // The table error is below an ADC step
+  int raw = analog_level[ angle_pin[ 0]];
+  CHECK( abs( axis( 0) - paddle_exact( paddle, raw)) <= paddle_exact( paddle, raw +1) - paddle_exact( paddle, raw));
+
+  printf("Test succeeded!\n");
+}
@@ -0,0 +1,250 @@
+
+// The PlayStation pad is modeled at the byte level: its state machine answers
+// the bytes exchanged through the SPI functions, it changes mode on the
+// configuration commands, and it pulses ACK after each byte but the last one.
+
+#define USB_PAD_ENCODER_CUSTOM_CONFIGURATION
+#define ENABLE_FULLSWITCH
+#define ENABLE_PSX
+#define USE_HAT_FOR_DPAD
+#define AUTOFIRE_MODE        NONE
+#define TAP_MAX_PERIOD       (200000)
+#define AUTOFIRE_PERIOD      (75000)
+#define AUTOFIRE_TAP_COUNT   (2)
+#define AUTOFIRE_SELECTOR    select
+#define DEBOUNCE_PERIOD      (5000)
+
+#include "test_hal.h"
+#include "usb_pad_encoder.h"
+
+#define ATTENTION_PIN 17
+#define ACK_PIN       FULLSWITCH_FIRE_7_PIN
+
+// Pad model ---------------------------------------------------------------------
+
+#define PAD_NONE        0
+#define PAD_DIGITAL     1 // SCPH-1080, it ignores the configuration
+#define PAD_DUALSHOCK   2
+#define PAD_DUALSHOCK_2 3
+
+typedef struct {
+  int type;
+  unsigned long max_hz;
+  int has_ack;
+  int analog, pressure, config;
+  uint8_t buttons[ 2]; // 0 = pressed
+  uint8_t sticks[ 4];  // RX RY LX LY
+  uint8_t pressures[ 12];
+  // Current transfer
+  uint8_t command[ 32];
+  int position;
+  int length;
+} pad_t;
+
+static pad_t pad;
+
+static unsigned long spi_hz = 0;
+static int spi_busy = 0;
+static int spi_ready = 0;
+static unsigned long spi_done_at = 0;
+static uint8_t spi_answer = 0;
+static unsigned long ack_at = 0;
+static int ack_pending = 0;
+static int bytes_sent = 0;
+
+static void pad_reset( int type){
+  memset( &pad, 0, sizeof( pad));
+  pad.type = type;
+  pad.max_hz = 500000;
+  pad.has_ack = 1;
+  pad.buttons[ 0] = pad.buttons[ 1] = 0xff;
+  for( int k = 0; k < 4; k += 1) pad.sticks[ k] = 128;
+}
+
+static uint8_t pad_id(void){
+  if( pad.type == PAD_DIGITAL) return 0x41;
+  if( pad.config) return 0xf3;
+  if( !pad.analog) return 0x41;
+  return pad.pressure ? 0x79 : 0x73;
+}
+
+static uint8_t pad_exchange( uint8_t data){
+  int k = pad.position;
+  pad.position += 1;
+  if( k < 32) pad.command[ k] = data;
+  if( k == 0) return 0xff;
+  if( pad.command[ 0] != 0x01) return 0xff;
+  if( k == 1){
+    uint8_t id = pad_id();
+    pad.length = 3 + 2 * ( id & 0x0f);
+    return id;
+  }
+  if( k == 2) return 0x5a;
+  if( k >= pad.length) return 0xff;
+  if( pad.config && pad.type != PAD_DIGITAL) return 0x00;
+  if( k < 5) return pad.buttons[ k -3];
+  if( k < 9) return pad.sticks[ k -5];
+  return pad.pressures[ k -9];
+}
+
+// The command takes effect when ATT goes high
+static void pad_end_transfer(void){
+  const uint8_t* c = pad.command;
+  if( pad.type != PAD_DIGITAL && pad.position >= 4){
+    if( c[ 1] == 0x43 && c[ 3] == 1) pad.config = 1;
+    if( c[ 1] == 0x43 && c[ 3] == 0 && pad.config) pad.config = 0;
+    if( c[ 1] == 0x44 && pad.config) pad.analog = c[ 3];
+    if( c[ 1] == 0x4f && pad.config && pad.type == PAD_DUALSHOCK_2) pad.pressure = 1;
+  }
+  pad.position = 0;
+  pad.length = 0;
+}
+
+static void on_write( uint8_t p, uint8_t v){
+  if( p == ATTENTION_PIN && v){
+    CHECK( !spi_busy);
+    pad_end_transfer();
+  }
+}
+
+static void spi_setup( unsigned long hz){
+  spi_hz = hz;
+}
+
+static void spi_start( uint8_t data){
+  CHECK( pin_level[ ATTENTION_PIN] == 0);
+  CHECK( !spi_busy && !ack_pending);
+  bytes_sent += 1;
+  spi_busy = 1;
+  spi_ready = 0;
+  spi_done_at = elapsed_us + 8000000 / spi_hz;
+  if( pad.type == PAD_NONE){
+    spi_answer = 0xff;
+    return;
+  }
+  int position = pad.position;
+  spi_answer = pad_exchange( data);
+  // Too fast: the pad does not see the first edges
+  if( spi_hz > pad.max_hz) spi_answer = spi_answer << 1 | 1;
+  if( pad.has_ack && ( position < 2 || position < pad.length -1)){
+    ack_at = spi_done_at + 10;
+    ack_pending = 1;
+  }
+}
+
+static int spi_result( void){
+  if( !spi_busy || elapsed_us < spi_done_at) return -1;
+  spi_busy = 0;
+  return spi_answer;
+}
+
+static void pad_tick(void){
+  if( !ack_pending) return;
+  if( elapsed_us >= ack_at) hal_set_pin( ACK_PIN, 0);
+  if( elapsed_us >= ack_at + 3){
+    hal_set_pin( ACK_PIN, 1);
+    ack_pending = 0;
+  }
+}
+
+#define INCLUDE_IMPLEMENTATION
+#include "usb_pad_encoder.h"
+#include "test_descriptor.h"
+
+// Test --------------------------------------------------------------------------
+
+static void run( unsigned long us){
+  unsigned long end = elapsed_us + us;
+  while( elapsed_us < end){
+    elapsed_us += 7;
+    pad_tick();
+    unsigned long start = elapsed_us;
+    usb_pad_encoder_step();
+    CHECK( elapsed_us == start); // it never waits
+  }
+}
+
+static gamepad_status_t* report(void){
+  return (gamepad_status_t*) hal_last_report();
+}
+
+static void connect( int type){
+  pad_reset( type);
+  run( PSX_DETECT_PERIOD + 20000);
+}
+
+int main(){
+  check_gamepad_layout();
+  hal_reset();
+  on_write_digital = on_write;
+  elapsed_us = 1;
+  pad_reset( PAD_NONE);
+  usb_pad_encoder_init();
+
+  // No pad: all the clocks are tried, then it waits
+  bytes_sent = 0;
+  run( 1000000);
+  CHECK( bytes_sent > 0 && bytes_sent < 10 * 3 * 4);
+  CHECK( report_count <= 1);
+
+  // DualShock 2: analog mode with pressure, at the fastest clock it accepts
+  connect( PAD_DUALSHOCK_2);
+  CHECK( pad.analog && pad.pressure && !pad.config);
+  CHECK( spi_hz == 500000);
+  pad.buttons[ 0] = ~( 0x01 | 0x10 | 0x20); // Select, Up, Right
+  pad.buttons[ 1] = ~( 0x20 | 0x40 | 0x01); // Circle, Cross, L2
+  pad.sticks[ 2] = 255;                     // LX
+  pad.sticks[ 3] = 0;                       // LY, up
+  pad.sticks[ 0] = 64;                      // RX
+  pad.pressures[ 10] = 255;                 // L2
+  pad.pressures[ 6] = 128;                  // Cross
+  run( 3000);
+  CHECK( report()->select && report()->fire1 && report()->fire2 && report()->fire7);
+  CHECK( !report()->start && !report()->fire3 && !report()->fire8);
+  CHECK( report()->direction == 2);
+  CHECK( report()->axis[ 0] == 32512 && report()->axis[ 1] == -32768);
+  CHECK( report()->axis[ 2] == -16384 && report()->axis[ 3] == 0);
+  CHECK( report()->axis[ 4] == 32767 && report()->axis[ 5] == -32768);
+  CHECK( report()->axis[ 6] == 128 * 257 - 32768 && report()->axis[ 7] == -32768);
+
+  // All the buttons together
+  pad.buttons[ 0] = pad.buttons[ 1] = 0;
+  run( 3000);
+  CHECK( report()->fire1 && report()->fire2 && report()->fire3 && report()->fire4);
+  CHECK( report()->fire5 && report()->fire6 && report()->fire7 && report()->fire8);
+  CHECK( report()->fire9 && report()->fire10 && report()->start && report()->select);
+
+  // Polled about every PSX_POLL_PERIOD, 21 bytes each
+  bytes_sent = 0;
+  run( 100000);
+  CHECK( bytes_sent >= 21 * 95 && bytes_sent <= 21 * 101);
+
+  // Removed
+  pad_reset( PAD_NONE);
+  run( 10000);
+  CHECK( !report()->fire1 && report()->direction == 0 && report()->axis[ 0] == 0);
+
+  // DualShock without the ACK line and with a slow clock
+  pad_reset( PAD_DUALSHOCK);
+  pad.has_ack = 0;
+  pad.max_hz = 250000;
+  run( PSX_DETECT_PERIOD + 20000);
+  CHECK( pad.analog && !pad.pressure);
+  CHECK( spi_hz == 250000);
+  pad.buttons[ 1] = ~0x02; // R2
+  pad.sticks[ 1] = 255;    // RY
+  run( 5000);
+  CHECK( report()->fire8 && report()->axis[ 3] == 32512);
+  CHECK( report()->axis[ 5] == 32767 && report()->axis[ 4] == -32768);
+
+  // Digital pad
+  pad_reset( PAD_NONE);
+  run( 10000);
+  connect( PAD_DIGITAL);
+  pad.buttons[ 0] = ~0x08; // Start
+  run( 3000);
+  CHECK( report()->start && report()->axis[ 0] == 0);
+  CHECK( report()->axis[ 4] == -32768);
+
+  printf("Test succeeded!\n");
+}
@@ -0,0 +1,168 @@
+
+// Benchmark used by settings_bench.sh: the same encoder configuration, built
+// with or without RUNTIME_SETTINGS (from the command line), is stepped with a
+// fixed random input, mostly idle or busy as chosen by the argument. It prints
+// the time of a step, in ns, the mean number of basic blocks run by a step,
+// and a hash of all the reports, that must be the same for the two builds.
+//
+// The blocks are counted only when built with -fsanitize-coverage=trace-pc,
+// otherwise they are 0. The input generation is counted too, but it is the
+// same for the two builds.
+
+#define USB_PAD_ENCODER_CUSTOM_CONFIGURATION
+#define ENABLE_FULLSWITCH
+#define ENABLE_SNES
+#define ENABLE_ATARI_PADDLE
+#define USE_HAT_FOR_DPAD
+#define AUTOFIRE_MODE        ASSIST
+#define TAP_MAX_PERIOD       (200000)
+#define AUTOFIRE_PERIOD      (75000)
+#define AUTOFIRE_TAP_COUNT   (2)
+#define AUTOFIRE_SELECTOR    select
+#define DEBOUNCE_PERIOD      (5000)
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define LOG(C, ...) do{ if( 0 && (C)) printf( __VA_ARGS__);} while(0)
+
+#define PIN_COUNT 32
+#define STEPS     1000000
+#define ROUNDS    7
+
+static int pin_level[ PIN_COUNT];
+static int analog_level[ PIN_COUNT];
+static unsigned long elapsed_us = 0;
+static uint8_t storage[ 64];
+static uint64_t hash;
+static volatile unsigned long long block_count = 0;
+
+// Not instrumented itself, it would call itself forever
+__attribute__(( no_sanitize_coverage)) void __sanitizer_cov_trace_pc( void){
+  block_count += 1;
+}
+
+static void setup_input( uint8_t p, uint8_t d){
+}
+
+static void setup_output( uint8_t p){
+}
+
+static unsigned long get_elasped_microsecond( void){
+  return elapsed_us;
+}
+
+static void delay_microsecond( unsigned long us){
+  elapsed_us += us;
+}
+
+static int read_digital( uint8_t p){
+  return pin_level[ p % PIN_COUNT];
+}
+
+static int read_analog( uint8_t p){
+  return analog_level[ p % PIN_COUNT];
+}
+
+static void write_digital( uint8_t p, uint8_t v){
+  pin_level[ p % PIN_COUNT] = v;
+}
+
+static void storage_read( uint16_t address, void* data, uint16_t size){
+  memcpy( data, storage + address, size);
+}
+
+static void storage_write( uint16_t address, const void* data, uint16_t size){
+  memcpy( storage + address, data, size);
+}
+
+static void disable_interrupts( void){
+  __asm__ __volatile__( "" ::: "memory");
+}
+
+static void enable_interrupts( void){
+  __asm__ __volatile__( "" ::: "memory");
+}
+
+static void use_hid_descriptor( const uint8_t* desc, size_t len){
+}
+
+// FNV-1a
+static void send_hid_report( int id, void* data, size_t len){
+  const uint8_t* byte = (const uint8_t*) data;
+  for( size_t k = 0; k < len; k += 1) hash = ( hash ^ byte[ k]) * 1099511628211ull;
+}
+
+#define INCLUDE_IMPLEMENTATION
+#include "usb_pad_encoder.h"
+
+static unsigned long random_state = 42;
+static unsigned long random_next( unsigned long max){
+  random_state = random_state * 1103515245 + 12345;
+  return ( random_state >> 8) % max;
+}
+
+// Mostly idle, as a real pad, with some presses and paddle moves
+static void drive_idle_input( void){
+  switch( random_next( 1024)){
+    case 0: case 1: case 2: case 3:
+      pin_level[ random_next( PIN_COUNT)] ^= 1;
+      break;
+    case 4:
+      analog_level[ random_next( PIN_COUNT)] = random_next( 1024);
+      break;
+  }
+}
+
+// A paddle moves at every step, as its ADC jitter does, so the fast path of
+// an unchanged input is never taken, and the presses are frequent
+static void drive_busy_input( void){
+  if( random_next( 16) == 0)
+    pin_level[ random_next( PIN_COUNT)] ^= 1;
+  const int angle = random_next( 2) ? ATARI_PADDLE_FIRST_ANGLE_PIN : ATARI_PADDLE_SECOND_ANGLE_PIN;
+  analog_level[ angle % PIN_COUNT] = random_next( 1024);
+}
+
+static double seconds( void){
+  struct timespec now;
+  clock_gettime( CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// The best of some rounds, each one from the same initial state: the hash and
+// the blocks are the same for all of them
+int main( int argc, char* argv[]){
+  int busy = argc > 1 && !strcmp( argv[ 1], "busy");
+  double best = 0;
+  unsigned long long blocks = 0;
+  for( int round = 0; round < ROUNDS; round += 1){
+    for( int k = 0; k < PIN_COUNT; k += 1){
+      pin_level[ k] = 1;
+      analog_level[ k] = 0;
+    }
+    memset( storage, 0xff, sizeof( storage));
+    random_state = 42;
+    hash = 14695981039346656037ull;
+    elapsed_us = 1;
+    usb_pad_encoder_init();
+
+    // The input generation is the same for the two builds, so it is counted too
+    block_count = 0;
+    double start = seconds();
+    for( long step = 0; step < STEPS; step += 1){
+      elapsed_us += 100 + random_next( 100);
+      if( busy) drive_busy_input();
+      else drive_idle_input();
+      usb_pad_encoder_step();
+    }
+    double elapsed = seconds() - start;
+    if( round == 0 || elapsed < best) best = elapsed;
+    blocks = block_count;
+  }
+
+  printf( "%.1f %.2f %016llx\n", best / STEPS * 1e9, (double) blocks / STEPS, (unsigned long long) hash);
+  return 0;
+}
@@ -0,0 +1,73 @@
+#!/bin/sh
+
+# Cost of a step with RUNTIME_SETTINGS, against the same configuration
+# specialized at compile time (see settings_bench.c), with a mostly idle input
+# and with a busy one, that never takes the fast path of an unchanged input.
+#
+# The two builds must send the same reports, otherwise the script fails. The
+# cost is the mean number of basic blocks run by a step, counted by a build
+# with -fsanitize-coverage=trace-pc: it does not depend on the host load, and
+# the script fails if the runtime build runs more than BENCH_THRESHOLD percent
+# (default 5) blocks than the static one.
+#
+# The time of a step is reported too, but it is measured on the host, so it
+# is noisy: the builds are run alternately BENCH_RUNS times (default 21) and
+# the medians are compared. A runtime build slower than the threshold is just
+# reported, unless BENCH_STRICT=1 is set.
+
+TESTDIR=$(readlink -f $(dirname "$0"))
+ROOTDIR=$(dirname "$TESTDIR")
+THRESHOLD=${BENCH_THRESHOLD:-5}
+RUNS=${BENCH_RUNS:-21}
+STRICT=${BENCH_STRICT:-0}
+
+set -e # automatic exit on error
+
+WORKDIR=$(mktemp -d)
+trap 'rm -fR "$WORKDIR"' EXIT
+
+gcc -O2 -I "$ROOTDIR" "$TESTDIR/settings_bench.c" -o "$WORKDIR/static"
+gcc -O2 -I "$ROOTDIR" -DRUNTIME_SETTINGS "$TESTDIR/settings_bench.c" -o "$WORKDIR/runtime"
+gcc -O2 -I "$ROOTDIR" -fsanitize-coverage=trace-pc "$TESTDIR/settings_bench.c" -o "$WORKDIR/static_blocks"
+gcc -O2 -I "$ROOTDIR" -DRUNTIME_SETTINGS -fsanitize-coverage=trace-pc "$TESTDIR/settings_bench.c" -o "$WORKDIR/runtime_blocks"
+
+FAILED=0
+for SCENARIO in idle busy; do
+  {
+    echo "static_blocks $("$WORKDIR/static_blocks" $SCENARIO)"
+    echo "runtime_blocks $("$WORKDIR/runtime_blocks" $SCENARIO)"
+    for RUN in $(seq "$RUNS"); do
+      echo "static $("$WORKDIR/static" $SCENARIO)"
+      echo "runtime $("$WORKDIR/runtime" $SCENARIO)"
+    done
+  } | awk -v scenario="$SCENARIO" -v threshold="$THRESHOLD" -v strict="$STRICT" '
+    function median( name,    k, j, t, n){
+      n = count[ name]
+      for( k = 2; k <= n; k += 1)
+        for( j = k; j > 1 && time[ name, j - 1] > time[ name, j]; j -= 1){
+          t = time[ name, j]; time[ name, j] = time[ name, j - 1]; time[ name, j - 1] = t
+        }
+      return time[ name, int( ( n + 1) / 2)]
+    }
+    $1 ~ /_blocks$/ { blocks[ $1] = $3 }
+    { count[ $1] += 1; time[ $1, count[ $1]] = $2 }
+    hash[ "all"] != "" && hash[ "all"] != $4 { different = 1 }
+    { hash[ "all"] = $4 }
+    END {
+      sb = blocks[ "static_blocks"]; rb = blocks[ "runtime_blocks"]
+      s = median( "static"); r = median( "runtime")
+      print scenario ": static " sb " blocks/step, runtime " rb " blocks/step"
+      print scenario ": static " s " ns/step, runtime " r " ns/step (median of " count[ "static"] ")"
+      if( different){ print scenario ": different reports"; exit 1 }
+      if( rb > sb * ( 1 + threshold / 100)){
+        print scenario ": runtime settings run more blocks than the threshold (" threshold "%)"
+        exit 1
+      }
+      if( r > s * ( 1 + threshold / 100)){
+        print scenario ": runtime settings slower than the threshold (" threshold "%)"
+        if( strict) exit 1
+      }
+    }
+  ' || FAILED=1
+done
+exit $FAILED
@@ -0,0 +1,196 @@
+
+// The runtime settings: the defaults come from the configuration, the feature
+// report changes them at the next step, and they are saved and loaded again at
+// the next init. The storage is checked by content, since the paddle saves its
+// range there too.
+
+#define USB_PAD_ENCODER_CUSTOM_CONFIGURATION
+#define ENABLE_FULLSWITCH
+#define ENABLE_SNES
+#define ENABLE_ATARI_PADDLE
+#define ENABLE_SPINNER
+#define RUNTIME_SETTINGS
+#define AUTOFIRE_MODE        ASSIST
+#define TAP_MAX_PERIOD       (200000)
+#define AUTOFIRE_PERIOD      (75000)
+#define AUTOFIRE_TAP_COUNT   (2)
+#define AUTOFIRE_SELECTOR    select
+#define DEBOUNCE_PERIOD      (5000)
+
+#include "test_hal.h"
+
+#define INCLUDE_IMPLEMENTATION
+#include "usb_pad_encoder.h"
+
+// Test --------------------------------------------------------------------------
+
+static void run( unsigned long us){
+  unsigned long end = elapsed_us + us;
+  while( elapsed_us < end){
+    elapsed_us += 100;
+    usb_pad_encoder_step();
+  }
+}
+
+static gamepad_status_t last_status( void){
+  gamepad_status_t status;
+  memcpy( &status, hal_last_report(), sizeof( status));
+  return status;
+}
+
+static usb_pad_encoder_settings_t current_settings( void){
+  usb_pad_encoder_settings_t settings;
+  CHECK( usb_pad_encoder_get_settings( (uint8_t*) &settings, sizeof( settings)) == sizeof( settings));
+  return settings;
+}
+
+static int send_settings( const usb_pad_encoder_settings_t* settings){
+  return usb_pad_encoder_set_settings( (const uint8_t*) settings, sizeof( *settings));
+}
+
+// Changes of fire1 in the reports sent during the given time
+static int fire1_changes( unsigned long us){
+  int first = report_count;
+  run( us);
+  int changes = 0;
+  for( int k = first; k < report_count; k += 1){
+    gamepad_status_t* status = (gamepad_status_t*) report_log[ k % TEST_REPORT_COUNT];
+    gamepad_status_t* previous = (gamepad_status_t*) report_log[ ( k -1) % TEST_REPORT_COUNT];
+    changes += status->fire1 != previous->fire1;
+  }
+  return changes;
+}
+
+int main(){
+
+  hal_reset();
+  elapsed_us = 1;
+  usb_pad_encoder_init();
+  run( 10000);
+
+  // Nothing saved: the defaults of the configuration
+  usb_pad_encoder_settings_t settings = current_settings();
+  CHECK( settings.version == SETTINGS_VERSION);
+  CHECK( settings.autofire_mode == ASSIST);
+  CHECK( settings.autofire_tap_count == AUTOFIRE_TAP_COUNT);
+  CHECK( settings.autofire_selector == 4);
+  CHECK( settings.protocols == ( SETTINGS_PROTOCOL_SNES | SETTINGS_PROTOCOL_ATARI_PADDLE | SETTINGS_PROTOCOL_SPINNER));
+  CHECK( settings.tap_max_period == TAP_MAX_PERIOD / 1000);
+  CHECK( settings.autofire_period == AUTOFIRE_PERIOD / 1000);
+  CHECK( settings.switch_pin[ 9] == FULLSWITCH_FIRE_4_PIN);
+  CHECK( storage_writes == 0);
+
+  // The SNES pins are not read as switches
+  hal_set_pin( FULLSWITCH_FIRE_8_PIN, 0);
+  hal_set_pin( FULLSWITCH_FIRE_4_PIN, 0);
+  run( 10000);
+  CHECK( !last_status().fire8);
+  CHECK( last_status().fire4);
+  hal_set_pin( FULLSWITCH_FIRE_8_PIN, 1);
+  hal_set_pin( FULLSWITCH_FIRE_4_PIN, 1);
+  run( 10000);
+
+  // The spinner pins drive the spinner
+  hal_set_pin( SPINNER_A_PIN, 0);
+  CHECK( spinner_count != 0);
+  hal_set_pin( SPINNER_A_PIN, 1);
+  run( 10000);
+
+  // Invalid settings are refused
+  usb_pad_encoder_settings_t wrong;
+  wrong = settings; wrong.version += 1;
+  CHECK( send_settings( &wrong) == -1);
+  wrong = settings; wrong.autofire_mode = 4;
+  CHECK( send_settings( &wrong) == -1);
+  wrong = settings; wrong.protocols |= SETTINGS_PROTOCOL_PSX;
+  CHECK( send_settings( &wrong) == -1);
+  wrong = settings; wrong.autofire_period = 0;
+  CHECK( send_settings( &wrong) == -1);
+  CHECK( usb_pad_encoder_set_settings( (const uint8_t*) &settings, sizeof( settings) -1) == -1);
+
+  // Pins that do not exist, that are used twice or that are used by the SNES
+  wrong = settings; wrong.switch_pin[ 9] = PLATFORM_PIN_COUNT;
+  CHECK( send_settings( &wrong) == -1);
+  wrong = settings; wrong.switch_pin[ 9] = 0xfe;
+  CHECK( send_settings( &wrong) == -1);
+  wrong = settings; wrong.switch_pin[ 9] = FULLSWITCH_FIRE_5_PIN;
+  CHECK( send_settings( &wrong) == -1);
+  wrong = settings; wrong.switch_pin[ 9] = SNES_LATCH_PIN;
+  CHECK( send_settings( &wrong) == -1);
+  wrong = settings; wrong.switch_pin[ 9] = ATARI_PADDLE_FIRST_ANGLE_PIN;
+  CHECK( send_settings( &wrong) == -1);
+  wrong = settings; wrong.switch_pin[ 9] = SETTINGS_NO_PIN; // a missing button is fine
+  CHECK( send_settings( &wrong) == 0);
+  run( 100);
+
+  // The defaults, as read, are accepted and saved
+  CHECK( send_settings( &settings) == 0);
+  run( 2 * sizeof( settings) * STORAGE_BYTE_WRITE_TIME);
+  CHECK( memcmp( storage + SETTINGS_STORAGE_ADDRESS, &settings, sizeof( settings)) == 0);
+
+  // New settings: no protocols, fire 4 and 5 swapped, toggle autofire on start
+  usb_pad_encoder_settings_t changed = settings;
+  changed.protocols = 0;
+  changed.switch_pin[ 9] = FULLSWITCH_FIRE_5_PIN;
+  changed.switch_pin[ 10] = FULLSWITCH_FIRE_4_PIN;
+  changed.autofire_mode = TOGGLE;
+  changed.autofire_selector = 5;
+  changed.autofire_period = 50;
+  CHECK( send_settings( &changed) == 0);
+  CHECK( send_settings( &changed) == -1); // the previous ones are pending
+  CHECK( current_settings().autofire_mode == ASSIST);
+  run( 100);
+  settings = current_settings();
+  CHECK( memcmp( &settings, &changed, sizeof( settings)) == 0);
+  run( 10000);
+
+  // The SNES pins are switches again, and the pins are swapped
+  hal_set_pin( FULLSWITCH_FIRE_8_PIN, 0);
+  hal_set_pin( FULLSWITCH_FIRE_5_PIN, 0);
+  run( 10000);
+  CHECK( last_status().fire8);
+  CHECK( last_status().fire4);
+  CHECK( !last_status().fire5);
+  hal_set_pin( FULLSWITCH_FIRE_8_PIN, 1);
+  hal_set_pin( FULLSWITCH_FIRE_5_PIN, 1);
+  run( 10000);
+
+  // The spinner interrupt is detached, its pin is the up switch now
+  hal_set_pin( SPINNER_A_PIN, 0);
+  CHECK( spinner_count == 0);
+  run( 10000);
+  CHECK( last_status().up);
+  hal_set_pin( SPINNER_A_PIN, 1);
+  run( 10000);
+
+  // Toggle autofire with the new selector and period
+  hal_set_pin( FULLSWITCH_FIRE_1_PIN, 0);
+  run( 10000);
+  CHECK( fire1_changes( 1000000) == 0);
+  hal_set_pin( FULLSWITCH_COIN_PIN, 0);
+  run( 10000);
+  hal_set_pin( FULLSWITCH_COIN_PIN, 1);
+  run( 10000);
+  int changes = fire1_changes( 1000000);
+  CHECK( changes >= 19 && changes <= 21);
+  hal_set_pin( FULLSWITCH_FIRE_1_PIN, 1);
+  run( 10000);
+
+  // Saved, and loaded at the next init
+  CHECK( memcmp( storage + SETTINGS_STORAGE_ADDRESS, &changed, sizeof( changed)) == 0);
+  usb_pad_encoder_init();
+  run( 10000);
+  settings = current_settings();
+  CHECK( memcmp( &settings, &changed, sizeof( settings)) == 0);
+  hal_set_pin( FULLSWITCH_FIRE_8_PIN, 0);
+  run( 10000);
+  CHECK( last_status().fire8);
+
+  // Erased storage: the defaults again
+  hal_reset();
+  elapsed_us = 1;
+  usb_pad_encoder_init();
+  CHECK( current_settings().protocols == ( SETTINGS_PROTOCOL_SNES | SETTINGS_PROTOCOL_ATARI_PADDLE | SETTINGS_PROTOCOL_SPINNER));
+
+  printf("Test succeeded!\n");
+}
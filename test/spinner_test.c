@@ -0,0 +1,101 @@
+
+#define USB_PAD_ENCODER_CUSTOM_CONFIGURATION
+#define ENABLE_FULLSWITCH
+#define ENABLE_SPINNER
+#define USE_HAT_FOR_DPAD
+#define AUTOFIRE_MODE      NONE
+#define TAP_MAX_PERIOD     (200000)
+#define AUTOFIRE_PERIOD    (75000)
+#define AUTOFIRE_TAP_COUNT (2)
+#define AUTOFIRE_SELECTOR  select
+#define DEBOUNCE_PERIOD    (5000)
+
+#include "test_hal.h"
+#define INCLUDE_IMPLEMENTATION
+#include "usb_pad_encoder.h"
+#include "test_descriptor.h"
+
+// Gray code sequence, A leads B when walked forward
+static const int gray_a[ 4] = { 0, 1, 1, 0};
+static const int gray_b[ 4] = { 0, 0, 1, 1};
+static int gray_phase = 0;
+
+static void spin( int direction){
+  gray_phase = ( gray_phase + direction) & 3;
+  // In real quadrature only one pin change at a time
+  hal_set_pin( SPINNER_A_PIN, gray_a[ gray_phase]);
+  hal_set_pin( SPINNER_B_PIN, gray_b[ gray_phase]);
+}
+
+static long reported = 0;
+static int reported_until = 0;
+
+// Run the encoder at 1 kHz while the spinner edges arrive at the given rate
+static void run( int direction, long edges, long edge_hz){
+  long edge_period = 1000000 / edge_hz;
+  unsigned long next_step = elapsed_us;
+  for( long e = 0; e < edges; e += 1){
+    elapsed_us += edge_period;
+    spin( direction);
+    while( elapsed_us >= next_step){
+      usb_pad_encoder_step();
+      next_step += 1000;
+    }
+  }
+}
+
+static void flush( int steps){
+  for( int k = 0; k < steps; k += 1){
+    elapsed_us += 1000;
+    usb_pad_encoder_step();
+  }
+  for( ; reported_until < report_count; reported_until += 1){
+    gamepad_status_t* report = (gamepad_status_t*) report_log[ reported_until % TEST_REPORT_COUNT];
+    reported += report->spinner;
+  }
+}
+
+int main(){
+  check_gamepad_layout();
+  hal_reset();
+  pin_level[ SPINNER_A_PIN] = 0;
+  pin_level[ SPINNER_B_PIN] = 0;
+  usb_pad_encoder_init();
+  CHECK( pin_change_isr[ SPINNER_A_PIN] && pin_change_isr[ SPINNER_B_PIN]);
+
+  // Steady rotation at several kHz
+  run( +1, 16000, 8000);
+  flush( 2);
+  CHECK( reported == 16000);
+
+  // Reverse
+  run( -1, 6000, 4000);
+  flush( 2);
+  CHECK( reported == 10000);
+
+  // Burst much faster than the reports can carry: the counts are kept
+  run( +1, 50000, 200000);
+  flush( 500);
+  CHECK( reported == 60000);
+
+  // Bounce on a single pin must cancel out
+  for( int k = 0; k < 1000; k += 1){
+    hal_set_pin( SPINNER_A_PIN, !pin_level[ SPINNER_A_PIN]);
+  }
+  flush( 2);
+  CHECK( reported == 60000);
+
+  // A missed edge (both pins changed) is ignored
+  pin_level[ SPINNER_A_PIN] = !pin_level[ SPINNER_A_PIN];
+  pin_level[ SPINNER_B_PIN] = !pin_level[ SPINNER_B_PIN];
+  pin_change_isr[ SPINNER_A_PIN]();
+  flush( 2);
+  CHECK( reported == 60000);
+
+  // No motion, no reports
+  int count = report_count;
+  flush( 100);
+  CHECK( report_count == count);
+
+  printf("Test succeeded!\n");
+}
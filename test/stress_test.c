@@ -0,0 +1,253 @@
+
+// Thousands of encoders, each one with its own context and its own random
+// input, stepped together by a thread for each core. Some of them are run
+// again alone, through the functions without the context: the reports must be
+// the same, so no state is shared between the contexts. The step rate of the
+// whole pool is printed.
+
+#define USB_PAD_ENCODER_CUSTOM_CONFIGURATION
+#define ENABLE_FULLSWITCH
+#define ENABLE_ATARI_PADDLE
+#define USE_HAT_FOR_DPAD
+#define AUTOFIRE_MODE        ASSIST
+#define TAP_MAX_PERIOD       (200000)
+#define AUTOFIRE_PERIOD      (75000)
+#define AUTOFIRE_TAP_COUNT   (2)
+#define AUTOFIRE_SELECTOR    select
+#define DEBOUNCE_PERIOD      (5000)
+#define DEBOUNCE_ADAPTIVE
+#define DEBOUNCE_MIN_PERIOD  (1000)
+#define DEBOUNCE_MAX_PERIOD  (10000)
+#define DEBOUNCE_MARGIN      (500)
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define LOG(C, ...) do{ if( 0 && (C)) printf( __VA_ARGS__);} while(0)
+#define CHECK(C) do{ if( !(C)){ printf( "%s:%d check failed: %s\n", __FILE__, __LINE__, #C); exit( 1);}} while(0)
+
+#include "usb_pad_encoder.h"
+
+// Per-encoder platform -----------------------------------------------------------
+
+#define PIN_COUNT 32
+
+typedef struct {
+  int pin_level[ PIN_COUNT];
+  int analog_level[ PIN_COUNT];
+  unsigned long elapsed_us;
+  unsigned long random_state;
+  int bounce_left;  // toggles of the bouncing switch
+  int bounce_pin;
+  uint64_t hash;    // of all the reports
+  long reports;
+  size_t report_size;
+  uint8_t storage[ 64];
+} platform_t;
+
+// The platform of the encoder that the thread is stepping
+static __thread platform_t* platform = 0;
+
+static void setup_input( uint8_t p, uint8_t d){
+}
+
+static void setup_output( uint8_t p){
+}
+
+static unsigned long get_elasped_microsecond(){
+  return platform->elapsed_us;
+}
+
+static void delay_microsecond(unsigned long us){
+  platform->elapsed_us += us;
+}
+
+static int read_digital( uint8_t p){
+  return platform->pin_level[ p];
+}
+
+static int read_analog( uint8_t p){
+  return platform->analog_level[ p];
+}
+
+static void write_digital( uint8_t p, uint8_t v){
+  platform->pin_level[ p] = v;
+}
+
+static void storage_read( uint16_t address, void* data, uint16_t size){
+  memcpy( data, platform->storage + address, size);
+}
+
+static void storage_write( uint16_t address, const void* data, uint16_t size){
+  memcpy( platform->storage + address, data, size);
+}
+
+static void use_hid_descriptor( const uint8_t* desc, size_t len){
+}
+
+// FNV-1a
+static void send_hid_report( int id, void* data, size_t len){
+  const uint8_t* byte = (const uint8_t*) data;
+  for( size_t k = 0; k < len; k += 1) platform->hash = ( platform->hash ^ byte[ k]) * 1099511628211ull;
+  platform->reports += 1;
+  platform->report_size = len;
+}
+
+#define INCLUDE_IMPLEMENTATION
+#include "usb_pad_encoder.h"
+
+// Input --------------------------------------------------------------------------
+
+static const uint8_t switch_pin[] = {
+  FULLSWITCH_UP_PIN, FULLSWITCH_DOWN_PIN, FULLSWITCH_LEFT_PIN, FULLSWITCH_RIGHT_PIN,
+  FULLSWITCH_SELECT_PIN, FULLSWITCH_COIN_PIN,
+  FULLSWITCH_FIRE_3_PIN, FULLSWITCH_FIRE_4_PIN, FULLSWITCH_FIRE_5_PIN,
+  FULLSWITCH_FIRE_6_PIN, FULLSWITCH_FIRE_7_PIN, FULLSWITCH_FIRE_8_PIN,
+  ATARI_PADDLE_FIRST_FIRE_PIN, ATARI_PADDLE_SECOND_FIRE_PIN,
+};
+#define SWITCHES ( sizeof( switch_pin) / sizeof( *switch_pin))
+
+static unsigned long random_next( platform_t* p, unsigned long max){
+  p->random_state = p->random_state * 1103515245 + 12345;
+  return ( p->random_state >> 8) % max;
+}
+
+static void platform_reset( platform_t* p, unsigned long seed){
+  memset( p, 0, sizeof( *p));
+  for( int k = 0; k < PIN_COUNT; k += 1) p->pin_level[ k] = 1;
+  memset( p->storage, 0xff, sizeof( p->storage));
+  p->random_state = seed;
+  p->elapsed_us = 1;
+  p->hash = 14695981039346656037ull;
+}
+
+// Fast bursts of activity: presses with bounce, paddle moves, and sometimes
+// all the switches together
+static void drive_input( platform_t* p){
+  p->elapsed_us += 100 + random_next( p, 400);
+  if( p->bounce_left > 0){
+    p->pin_level[ p->bounce_pin] ^= 1;
+    p->bounce_left -= 1;
+    return;
+  }
+  switch( random_next( p, 64)){
+    case 0: case 1: case 2: case 3:
+      p->pin_level[ switch_pin[ random_next( p, SWITCHES)]] ^= 1;
+      break;
+    case 4:
+      p->bounce_pin = switch_pin[ random_next( p, SWITCHES)];
+      p->bounce_left = 2 * random_next( p, 4) + 1;
+      break;
+    case 5:
+      p->analog_level[ ATARI_PADDLE_FIRST_ANGLE_PIN] = random_next( p, 1024);
+      break;
+    case 6:
+      p->analog_level[ ATARI_PADDLE_SECOND_ANGLE_PIN] = random_next( p, 1024);
+      break;
+    case 7:
+      for( size_t k = 0; k < SWITCHES; k += 1) p->pin_level[ switch_pin[ k]] = random_next( p, 8) == 0;
+      break;
+  }
+}
+
+// Pool ---------------------------------------------------------------------------
+
+#define ENCODERS 4096
+#define STEPS    1000
+#define CHECKED  64 // encoders run again alone
+
+typedef struct {
+  platform_t platform;
+  usb_pad_encoder_t* ctx;
+} encoder_t;
+
+typedef struct {
+  encoder_t* encoder;
+  int count;
+} worker_t;
+
+static encoder_t encoder[ ENCODERS];
+
+// The encoders of the worker are stepped in turn, so their contexts interleave
+static void* worker_run( void* arg){
+  worker_t* w = (worker_t*) arg;
+  for( int k = 0; k < w->count; k += 1){
+    platform = &w->encoder[ k].platform;
+    usb_pad_encoder_init_context( w->encoder[ k].ctx);
+  }
+  for( int step = 0; step < STEPS; step += 1){
+    for( int k = 0; k < w->count; k += 1){
+      platform = &w->encoder[ k].platform;
+      drive_input( platform);
+      usb_pad_encoder_step_context( w->encoder[ k].ctx);
+    }
+  }
+  return 0;
+}
+
+static double seconds(void){
+  struct timespec now;
+  clock_gettime( CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+int main(){
+  int threads = sysconf( _SC_NPROCESSORS_ONLN);
+  if( threads < 1) threads = 1;
+  if( threads > 64) threads = 64;
+
+  for( int k = 0; k < ENCODERS; k += 1){
+    platform_reset( &encoder[ k].platform, 1000 + k);
+    encoder[ k].ctx = malloc( usb_pad_encoder_context_size());
+    CHECK( encoder[ k].ctx);
+  }
+
+  pthread_t thread[ 64];
+  worker_t worker[ 64];
+  double start = seconds();
+  for( int t = 0; t < threads; t += 1){
+    int first = ENCODERS * t / threads;
+    worker[ t].encoder = encoder + first;
+    worker[ t].count = ENCODERS * ( t + 1) / threads - first;
+    CHECK( pthread_create( thread + t, 0, worker_run, worker + t) == 0);
+  }
+  for( int t = 0; t < threads; t += 1) CHECK( pthread_join( thread[ t], 0) == 0);
+  double elapsed = seconds() - start;
+
+  long reports = 0;
+  for( int k = 0; k < ENCODERS; k += 1){
+    CHECK( encoder[ k].platform.reports > 0);
+    CHECK( encoder[ k].platform.report_size == sizeof( gamepad_status_t));
+    reports += encoder[ k].platform.reports;
+  }
+
+  // The same input, alone in the default context
+  for( int n = 0; n < CHECKED; n += 1){
+    int k = n * ( ENCODERS / CHECKED) + n % ( ENCODERS / CHECKED);
+    platform_t alone;
+    platform_reset( &alone, 1000 + k);
+    platform = &alone;
+    usb_pad_encoder_init();
+    for( int step = 0; step < STEPS; step += 1){
+      drive_input( platform);
+      usb_pad_encoder_step();
+    }
+    CHECK( alone.reports == encoder[ k].platform.reports);
+    CHECK( alone.hash == encoder[ k].platform.hash);
+  }
+
+  double steps = (double) ENCODERS * STEPS;
+  printf( "encoders %d, threads %d, context %zu bytes, reports %ld\n",
+          ENCODERS, threads, usb_pad_encoder_context_size(), reports);
+  printf( "steps %.0f in %.3f s: %.1f Msteps/s, %.1f ns/step/thread\n",
+          steps, elapsed, steps / elapsed * 1e-6, elapsed * threads / steps * 1e9);
+
+  for( int k = 0; k < ENCODERS; k += 1) free( encoder[ k].ctx);
+  printf("Test succeeded!\n");
+}
@@ -0,0 +1,105 @@
+
+// Walks a HID report descriptor as the host does, to check that the fields it
+// declares are where gamepad_status_t stores them. Only the items used by the
+// encoder are handled. check_gamepad_layout must be included after the
+// implementation.
+
+#define DESCRIPTOR_MAX_FIELDS 64
+
+typedef struct {
+  uint16_t page;
+  uint16_t usage;    // 0 for the constant ones
+  int bit;           // offset in the report, after the id
+  int size;          // bits
+} descriptor_field_t;
+
+static descriptor_field_t descriptor_field[ DESCRIPTOR_MAX_FIELDS];
+static int descriptor_field_count = 0;
+static int descriptor_bits = 0;
+
+// Fills descriptor_field with the input fields of the report with the given id
+static void descriptor_walk( const uint8_t* desc, size_t len, int report_id){
+  uint16_t page = 0, usage[ 16];
+  int usage_count = 0, usage_min = -1;
+  int size = 0, count = 0, id = 0;
+  descriptor_field_count = 0;
+  descriptor_bits = 0;
+  for( size_t k = 0; k < len;){
+    uint8_t prefix = desc[ k];
+    int data_len = ( prefix & 3) == 3 ? 4 : prefix & 3;
+    uint32_t data = 0;
+    for( int d = 0; d < data_len; d += 1) data |= (uint32_t) desc[ k + 1 + d] << ( 8 * d);
+    k += 1 + data_len;
+    switch( prefix & 0xfc){
+      case 0x04: page = data; break;                           // USAGE_PAGE
+      case 0x74: size = data; break;                           // REPORT_SIZE
+      case 0x94: count = data; break;                          // REPORT_COUNT
+      case 0x84: id = data; break;                             // REPORT_ID
+      case 0x08: usage[ usage_count++ & 15] = data; break;     // USAGE
+      case 0x18: usage_min = data; break;                      // USAGE_MINIMUM
+      case 0x80:                                               // INPUT
+        if( id == report_id){
+          for( int f = 0; f < count; f += 1){
+            descriptor_field_t* field = descriptor_field + descriptor_field_count++;
+            field->page = page;
+            field->bit = descriptor_bits;
+            field->size = size;
+            if( data & 1) field->usage = 0;
+            else if( usage_min >= 0) field->usage = usage_min + f;
+            else field->usage = usage[ ( f < usage_count ? f : usage_count - 1) & 15];
+            descriptor_bits += size;
+          }
+        }
+        // fall through
+      case 0xa0: case 0xb0: case 0xc0:                         // COLLECTION, FEATURE, END
+        usage_count = 0;
+        usage_min = -1;
+        break;
+    }
+  }
+}
+
+// Bit offset of the field with the given usage, or -1
+static int descriptor_usage_bit( uint16_t page, uint16_t usage){
+  for( int k = 0; k < descriptor_field_count; k += 1)
+    if( descriptor_field[ k].page == page && descriptor_field[ k].usage == usage)
+      return descriptor_field[ k].bit;
+  return -1;
+}
+
+// Offset of the first bit set in a report, to find the bit fields
+static int report_first_bit( const void* report, size_t size){
+  const uint8_t* data = (const uint8_t*) report;
+  for( size_t k = 0; k < size * 8; k += 1)
+    if( data[ k / 8] >> ( k % 8) & 1) return k;
+  return -1;
+}
+
+#if defined( INCLUDE_IMPLEMENTATION) && OUTPUT_MODE == JOYSTICK
+static void check_gamepad_layout( void){
+  gamepad_status_t status;
+
+  descriptor_walk( gamepad_hid_descriptor, sizeof( gamepad_hid_descriptor), HID_REPORT_ID);
+  CHECK( descriptor_bits == 8 * sizeof( gamepad_status_t));
+
+#if HID_BUTTONS > 0
+  CHECK( descriptor_usage_bit( 0x09, 1) == HID_BUTTON_OFFSET);
+#endif // HID_BUTTONS
+
+#ifdef USE_HAT_FOR_DPAD
+  memset( &status, 0, sizeof( status));
+  status.direction = 1;
+  CHECK( descriptor_usage_bit( 0x01, 0x39) == report_first_bit( &status, sizeof( status)));
+#endif // USE_HAT_FOR_DPAD
+
+#if HID_AXIS > 0
+  static const uint16_t axis_usage[ 8] = { 0x30, 0x31, 0x33, 0x34, 0x32, 0x35, 0x36, 0x38};
+  for( int k = 0; k < HID_AXIS; k += 1)
+    CHECK( descriptor_usage_bit( 0x01, axis_usage[ k]) == (int)( 8 * ( offsetof( gamepad_status_t, axis) + 2 * k)));
+#endif // HID_AXIS
+
+#ifdef ENABLE_SPINNER
+  CHECK( descriptor_usage_bit( 0x01, 0x37) == (int)( 8 * offsetof( gamepad_status_t, spinner)));
+#endif // ENABLE_SPINNER
+}
+#endif // INCLUDE_IMPLEMENTATION && OUTPUT_MODE
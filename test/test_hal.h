@@ -0,0 +1,146 @@
+
+// Host implementation of the functions needed by usb_pad_encoder.h, shared by
+// the tests. The pins are plain arrays that a test, or a device model hooked on
+// write_digital, can drive. Every HID report sent is recorded.
+//
+// Include it before the implementation of usb_pad_encoder.h, e.g.:
+//   #include "test_hal.h"
+//   #define INCLUDE_IMPLEMENTATION
+//   #include "usb_pad_encoder.h"
+
+#ifndef TEST_HAL_H
+#define TEST_HAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef TEST_VERBOSE
+#define TEST_VERBOSE 0
+#endif
+
+#define LOG(C, ...) do{ if( TEST_VERBOSE && (C)){ printf( "%s:%d ", __FILE__, __LINE__); printf( __VA_ARGS__); printf( "\n");}} while(0)
+
+#define CHECK(C) do{ if( !(C)){ printf( "%s:%d check failed: %s\n", __FILE__, __LINE__, #C); exit( 1);}} while(0)
+
+#define PROGMEM
+
+#define TEST_PIN_COUNT    32
+#define TEST_REPORT_SIZE  64
+#define TEST_REPORT_COUNT 4096
+#define TEST_STORAGE_SIZE 1024
+
+static int pin_level[ TEST_PIN_COUNT];
+static int analog_level[ TEST_PIN_COUNT];
+static unsigned long elapsed_us = 0;
+
+// Optional device model: it is called after each write, so it can update the
+// pin_level of its outputs.
+static void (*on_write_digital)( uint8_t p, uint8_t v) = 0;
+
+// Optional device model: it is called before each read, e.g. to change an
+// output only some time after the last write.
+static void (*on_read_digital)( uint8_t p) = 0;
+
+static void (*pin_change_isr[ TEST_PIN_COUNT])(void);
+
+static uint8_t report_log[ TEST_REPORT_COUNT][ TEST_REPORT_SIZE];
+static size_t report_size = 0;
+static int report_count = 0;
+
+// The EEPROM: it keeps its content across the encoder inits, until hal_reset
+static uint8_t storage[ TEST_STORAGE_SIZE];
+static int storage_writes = 0;
+
+static void hal_reset(void){
+  for( int p = 0; p < TEST_PIN_COUNT; p += 1){
+    pin_level[ p] = 1; // all the inputs are pulled up
+    analog_level[ p] = 0;
+    pin_change_isr[ p] = 0;
+  }
+  on_write_digital = 0;
+  on_read_digital = 0;
+  elapsed_us = 0;
+  report_size = 0;
+  report_count = 0;
+  memset( storage, 0xff, sizeof( storage)); // erased
+  storage_writes = 0;
+}
+
+// Change an input and fire its interrupt, as the hardware would do
+static void hal_set_pin( uint8_t p, int v){
+  if( pin_level[ p] == v) return;
+  pin_level[ p] = v;
+  if( pin_change_isr[ p]) pin_change_isr[ p]();
+}
+
+static const uint8_t* hal_last_report(void){
+  CHECK( report_count > 0);
+  return report_log[ ( report_count -1) % TEST_REPORT_COUNT];
+}
+
+static void setup_input( uint8_t p, uint8_t d){
+}
+
+static void setup_output( uint8_t p){
+}
+
+static unsigned long get_elasped_microsecond(){
+  return elapsed_us;
+}
+
+static void delay_microsecond(unsigned long us){
+  elapsed_us += us;
+}
+
+static int read_digital( uint8_t p){
+  if( on_read_digital) on_read_digital( p);
+  return pin_level[ p];
+}
+
+static int read_analog( uint8_t p){
+  return analog_level[ p];
+}
+
+static void write_digital( uint8_t p, uint8_t v){
+  pin_level[ p] = v;
+  if( on_write_digital) on_write_digital( p, v);
+}
+
+static void attach_pin_change( uint8_t p, void (*isr)(void)){
+  pin_change_isr[ p] = isr;
+}
+
+// Just compiler barriers, as the ones of the platform
+static void disable_interrupts(void){
+  __asm__ __volatile__( "" ::: "memory");
+}
+
+static void enable_interrupts(void){
+  __asm__ __volatile__( "" ::: "memory");
+}
+
+static void storage_read( uint16_t address, void* data, uint16_t size){
+  CHECK( address + size <= TEST_STORAGE_SIZE);
+  memcpy( data, storage + address, size);
+}
+
+static void storage_write( uint16_t address, const void* data, uint16_t size){
+  CHECK( address + size <= TEST_STORAGE_SIZE);
+  memcpy( storage + address, data, size);
+  storage_writes += 1;
+}
+
+static void use_hid_descriptor( const uint8_t* desc, size_t len){
+}
+
+static void send_hid_report( int id, void* data, size_t len){
+  CHECK( len <= TEST_REPORT_SIZE);
+  report_size = len;
+  memcpy( report_log[ report_count % TEST_REPORT_COUNT], data, len);
+  report_count += 1;
+}
+
+#endif // TEST_HAL_H
@@ -26,21 +26,51 @@ The "USB pad encoder with Arduino"'s Authors, 2023
 // This is written as a single file library. Include it as a normal header
 // where you needed to call its functions, i.e:
 //   usb_pad_encoder_init, usb_pad_encoder_step
+// or their reentrant versions, that take an explicit encoder context:
+//   usb_pad_encoder_init_context, usb_pad_encoder_step_context
 // Moreover it must be included in a single place after the definition of the
 //   INCLUDE_IMPLEMENTION
 // macro (it will include the actual code). In such place the following
 // functions or macros MUST be visible:
 //   LOG, setup_input, setup_output, get_elasped_microsecond, delay_microsecond,
 //   read_digital, read_analog, write_digital, use_hid_descriptor, send_hid_report
+// When ENABLE_SPINNER is set, also the following ones are needed:
+//   attach_pin_change, disable_interrupts, enable_interrupts
+// When ENABLE_JOYBUS is set, also the following one is needed (look at the
+// N64 and GameCube section for its specification):
+//   joybus_transfer
+// When ENABLE_PSX is set, also the following ones are needed (look at the
+// PlayStation section for their specification):
+//   spi_setup, spi_start, spi_result, attach_pin_change
+// When ENABLE_ATARI_PADDLE or RUNTIME_SETTINGS is set, also the following ones
+// are needed (look at the Persistent storage section for their specification):
+//   storage_read, storage_write
+// When RUNTIME_SETTINGS is set, also the following ones are needed (they must
+// be compiler barriers too, like the cli/sei of the AVR):
+//   disable_interrupts, enable_interrupts
+// and the platform must call the following ones on the requests of the
+// settings feature report (look at their declaration):
+//   usb_pad_encoder_get_settings, usb_pad_encoder_set_settings
 // Moreover the following macro must be set if some platform need additional
 // attributes for the HID descriptor array:
 //   HID_DESCRIPTOR_ATTRIBUTE
+// and the following one if the platform has not the 31 digital pins of the
+// Arduino Micro (the pins sent by the host with RUNTIME_SETTINGS must be lower):
+//   PLATFORM_PIN_COUNT
+// If USB_PAD_ENCODER_CUSTOM_CONFIGURATION is defined before the inclusion, the
+// Configuration section is skipped and all its macros must be provided by the
+// includer (e.g. the host tests).
 
 // Configuration ------------------------------------------------------------------
+#ifndef USB_PAD_ENCODER_CUSTOM_CONFIGURATION
 
 #define ENABLE_SNES
 #define ENABLE_FULLSWITCH
 //#define ENABLE_ATARI_PADDLE
+//#define ENABLE_SPINNER
+//#define ENABLE_JOYBUS
+//#define ENABLE_PSX
+//#define ENABLE_GENESIS
 
 #define AUTOFIRE_MODE      ASSIST   // NONE, ASSIST, TOGGLE
 #define TAP_MAX_PERIOD     (200000) // us // used in any mode except none
@@ -51,25 +81,72 @@ The "USB pad encoder with Arduino"'s Authors, 2023
 // This will make the dpad looks like a pair of "Digital axis"
 #define USE_HAT_FOR_DPAD
 
+#define OUTPUT_MODE        JOYSTICK // JOYSTICK, KEYBOARD; the keyboard one sends the keys listed in the Advanced Configuration, without hat and axis
+
+//#define RUNTIME_SETTINGS          // the autofire options, the protocols and the full-switch pins above are just the defaults of settings saved in the EEPROM, that the host can change with a HID feature report
+
+#define DEBOUNCE_PERIOD      (5000)  // us // fixed debounce window, or the initial one in adaptive mode
+//#define DEBOUNCE_ADAPTIVE          // measure the bounce of each switch and adapt its window to it
+#define DEBOUNCE_MIN_PERIOD  (1000)  // us // used in adaptive mode; it is also the quiet time that ends a bounce
+#define DEBOUNCE_MAX_PERIOD  (10000) // us // used in adaptive mode; it is also the longest measurable bounce
+#define DEBOUNCE_MARGIN      (500)   // us // used in adaptive mode; added to the measured bounce
+
+#endif // USB_PAD_ENCODER_CUSTOM_CONFIGURATION
+
 // Advanced Configuration ---------------------------------------------------------
 
-#define FULLSWITCH_UP_PIN      16
-#define FULLSWITCH_DOWN_PIN     8
-#define FULLSWITCH_LEFT_PIN    14
-#define FULLSWITCH_RIGHT_PIN    7
+#define FULLSWITCH_UP_PIN      16 // This will be used also as: SPINNER_A_PIN or PSX_COMMAND_PIN or GENESIS_UP_PIN
+#define FULLSWITCH_DOWN_PIN     8 // This will be used also as: SPINNER_B_PIN or GENESIS_DOWN_PIN
+#define FULLSWITCH_LEFT_PIN    14 // This will be used also as: PSX_DATA_PIN or GENESIS_LEFT_PIN
+#define FULLSWITCH_RIGHT_PIN    7 // This will be used also as: GENESIS_RIGHT_PIN
 #define FULLSWITCH_SELECT_PIN  19
 #define FULLSWITCH_COIN_PIN    20
-#define FULLSWITCH_FIRE_1_PIN  15 // This will be used also as: ATARI_PADDLE_FIRST_FIRE_PIN
-#define FULLSWITCH_FIRE_2_PIN   6 // This will be used olso as: ATARI_PADDLE_SECOND_FIRE_PIN
-#define FULLSWITCH_FIRE_3_PIN   9
+#define FULLSWITCH_FIRE_1_PIN  15 // This will be used also as: ATARI_PADDLE_FIRST_FIRE_PIN or PSX_CLOCK_PIN or GENESIS_TL_PIN
+#define FULLSWITCH_FIRE_2_PIN   6 // This will be used olso as: ATARI_PADDLE_SECOND_FIRE_PIN or GENESIS_TR_PIN
+#define FULLSWITCH_FIRE_3_PIN   9 // This will be used also as: GENESIS_SELECT_PIN
 #define FULLSWITCH_FIRE_4_PIN   5
 #define FULLSWITCH_FIRE_5_PIN  10
-#define FULLSWITCH_FIRE_6_PIN   2 // This will be used also as: SNES_DATA_PIN
-#define FULLSWITCH_FIRE_7_PIN   3 // This will be used also as: SNES_LATCH_PIN
+#define FULLSWITCH_FIRE_6_PIN   2 // This will be used also as: SNES_DATA_PIN or JOYBUS_DATA_PIN
+#define FULLSWITCH_FIRE_7_PIN   3 // This will be used also as: SNES_LATCH_PIN or PSX_ACK_PIN
 #define FULLSWITCH_FIRE_8_PIN   4 // This will be used also as: SNES_CLOCK_PIN or SNES_DATA_PIN
 #define FULLSWITCH_FIRE_9_PIN  18 // Must be Analog - This will be used also as: ATARI_PADDLE_FIRST_ANGLE_PIN or SNES_DATA_PIN
 #define FULLSWITCH_FIRE_10_PIN 21 // Must be Analog - This will be used also as: ATARI_PADDLE_SECOND_ANGLE_PIN or SNES_LATCH_PIN
 
+// Calibration of the Atari paddles: the range of each paddle is learned while it
+// is used, and it is saved in the EEPROM once it does not change for a while.
+// Holding both the paddle fires at power up forgets the saved range.
+#define ATARI_PADDLE_STORAGE_ADDRESS (0)       // EEPROM byte // 10 bytes are used
+#define ATARI_PADDLE_SAVE_DELAY      (5000000) // us // the range must be stable for this time before it is saved
+#define ATARI_PADDLE_MIN_SPAN        (64)      // ADC units // narrower ranges are stretched to this
+#define ATARI_PADDLE_TABLE_SIZE      (32)      // #  // segments of the linearization table
+
+// Settings of RUNTIME_SETTINGS, saved in the EEPROM
+#define SETTINGS_STORAGE_ADDRESS     (16)      // EEPROM byte // sizeof( usb_pad_encoder_settings_t) bytes are used
+
+// The EEPROM is written one byte at a time, so the steps never wait for it
+#define STORAGE_BYTE_WRITE_TIME      (4000)    // us // between two bytes
+
+// Keys sent by the KEYBOARD output mode, as HID usage codes: 0x04-0x67 (e.g.
+// 0x04-0x1d = A-Z, 0x1e-0x27 = 1-0, 0x2c = Space, 0x4f-0x52 = Right, Left,
+// Down, Up) or the modifiers 0xe0-0xe7 (e.g. 0xe0 = Left Ctrl, 0xe1 = Left
+// Shift, 0xe2 = Left Alt). 0 means no key. The default is the MAME player 1.
+#define KEYBOARD_KEY_UP      0x52 // Up
+#define KEYBOARD_KEY_DOWN    0x51 // Down
+#define KEYBOARD_KEY_LEFT    0x50 // Left
+#define KEYBOARD_KEY_RIGHT   0x4f // Right
+#define KEYBOARD_KEY_SELECT  0x22 // 5, coin
+#define KEYBOARD_KEY_START   0x1e // 1
+#define KEYBOARD_KEY_FIRE_1  0xe0 // Left Ctrl
+#define KEYBOARD_KEY_FIRE_2  0xe2 // Left Alt
+#define KEYBOARD_KEY_FIRE_3  0x2c // Space
+#define KEYBOARD_KEY_FIRE_4  0xe1 // Left Shift
+#define KEYBOARD_KEY_FIRE_5  0x1d // Z
+#define KEYBOARD_KEY_FIRE_6  0x1b // X
+#define KEYBOARD_KEY_FIRE_7  0x06 // C
+#define KEYBOARD_KEY_FIRE_8  0x19 // V
+#define KEYBOARD_KEY_FIRE_9  0x05 // B
+#define KEYBOARD_KEY_FIRE_10 0x11 // N
+
 /*
 // Old Jamma Coin Op Adapter
 // NOTE atari and snes must be disabled
@@ -101,11 +178,94 @@ The "USB pad encoder with Arduino"'s Authors, 2023
 #define USB_PAD_ENCODER_H
 
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 
 void usb_pad_encoder_init();
 void usb_pad_encoder_step();
 
+// Reentrant versions: all the state of an encoder is in its context, so more
+// encoders can run together, e.g. in a host simulation. The platform functions
+// are shared, so they must tell the encoders apart by themselves (e.g. with a
+// per-thread pin array); the pin-change interrupts of the spinner and of the
+// PlayStation ACK are attached to the hardware, so they are shared too. The
+// functions without the context use a default one.
+typedef struct usb_pad_encoder_s usb_pad_encoder_t;
+size_t usb_pad_encoder_context_size( void);
+void usb_pad_encoder_init_context( usb_pad_encoder_t* ctx);
+void usb_pad_encoder_step_context( usb_pad_encoder_t* ctx);
+
+// Microseconds before the encoder needs a step also if no input changes (e.g.
+// for the autofire or at the end of a debounce), -1 if never. A host that can
+// sleep between the steps waits for this or for an input change.
+long usb_pad_encoder_wake_delay( void);
+long usb_pad_encoder_wake_delay_context( usb_pad_encoder_t* ctx);
+
+#ifdef DEBOUNCE_ADAPTIVE
+typedef struct {
+  uint16_t window;     // us // current debounce window
+  uint16_t estimate;   // us // recent bounce, slowly decaying
+  uint16_t max_bounce; // us // longest bounce ever seen
+  uint16_t changes;    // #  // accepted press/release
+  uint16_t bounced;    // #  // press/release with some bounce
+  uint16_t glitches;   // #  // bounces longer than the window, i.e. sent to the host
+} bounce_stat_t;
+
+// Switch indexes: 0-15 the full-switch pins in the Advanced Configuration
+// order (Up, Down, ..., Fire 10), 16-17 the Atari paddle fires. It returns 0
+// if the switch was never sampled.
+int usb_pad_encoder_bounce_stat( int index, bounce_stat_t* stat);
+int usb_pad_encoder_bounce_stat_context( usb_pad_encoder_t* ctx, int index, bounce_stat_t* stat);
+
+// The statistics of all the switches are also a read-only feature report, so
+// they can be read from the host on every build: BOUNCE_SWITCHES bounce_stat_t,
+// little endian, in the switch index order; the never sampled ones are 0. The
+// platform must call the following function on its get request: it fills the
+// data after the report ID, and it returns its size, or -1 if it does not fit.
+#define BOUNCE_REPORT_ID (0x08)
+#define BOUNCE_SWITCHES  (18)
+int usb_pad_encoder_get_bounce_report( uint8_t* report, int size);
+int usb_pad_encoder_get_bounce_report_context( usb_pad_encoder_t* ctx, uint8_t* report, int size);
+#endif // DEBOUNCE_ADAPTIVE
+
+#ifdef RUNTIME_SETTINGS
+#define SETTINGS_VERSION   (1)
+#define SETTINGS_REPORT_ID (0x07)
+#define SETTINGS_NO_PIN    (0xff)
+
+#define SETTINGS_PROTOCOL_SNES         (0x01)
+#define SETTINGS_PROTOCOL_ATARI_PADDLE (0x02)
+#define SETTINGS_PROTOCOL_SPINNER      (0x04)
+#define SETTINGS_PROTOCOL_JOYBUS       (0x08)
+#define SETTINGS_PROTOCOL_PSX          (0x10)
+#define SETTINGS_PROTOCOL_GENESIS      (0x20)
+
+// The settings, as saved in the EEPROM and as sent in the feature report:
+// little endian, without padding. The protocols can be only the built ones
+// (the ENABLE_* macros), and the ones that share a full-switch pin disable it.
+typedef struct {
+  uint8_t version;            // SETTINGS_VERSION
+  uint8_t autofire_mode;      // 1 = NONE, 2 = ASSIST, 3 = TOGGLE
+  uint8_t autofire_tap_count; // #  // used in assist mode
+  uint8_t autofire_selector;  // full-switch index, e.g. 4 = select; used in toggle mode
+  uint16_t protocols;         // SETTINGS_PROTOCOL_* bits
+  uint16_t tap_max_period;    // ms
+  uint16_t autofire_period;   // ms
+  uint8_t switch_pin[ 16];    // full-switch pins, in the Advanced Configuration order; SETTINGS_NO_PIN if not used
+} usb_pad_encoder_settings_t;
+
+// The platform calls these on the GET_REPORT and SET_REPORT requests for the
+// SETTINGS_REPORT_ID feature report, with the data after the report ID. The get
+// returns the size of the settings, or -1 if the buffer is too small. The set
+// returns -1 if the settings are not valid, or if the previous ones were not
+// applied yet (the host should retry). They can be called by an interrupt:
+// the new settings are applied, and saved, by the next steps.
+int usb_pad_encoder_get_settings( uint8_t* report, int size);
+int usb_pad_encoder_set_settings( const uint8_t* report, int size);
+int usb_pad_encoder_get_settings_context( usb_pad_encoder_t* ctx, uint8_t* report, int size);
+int usb_pad_encoder_set_settings_context( usb_pad_encoder_t* ctx, const uint8_t* report, int size);
+#endif // RUNTIME_SETTINGS
+
 #endif // USB_PAD_ENCODER_H
 
 // Implementation guard  ----------------------------------------------------------
@@ -119,11 +279,41 @@ void usb_pad_encoder_step();
 #define HID_DESCRIPTOR_ATTRIBUTE
 #endif
 
+// The ones of the Arduino Micro
+#ifndef PLATFORM_PIN_COUNT
+#define PLATFORM_PIN_COUNT 31
+#endif
+
 #ifdef ENABLE_FULLSWITCH
 #else // ENABLE_FULLSWITCH
 #error fullswitch can not be turned of currently
 #endif // ENABLE_FULLSWITCH
 
+#define JOYSTICK 1
+#define KEYBOARD 2
+
+#ifndef OUTPUT_MODE
+#define OUTPUT_MODE JOYSTICK
+#endif
+
+#if OUTPUT_MODE == KEYBOARD
+// The keyboard has no hat: the directions are keys too
+#undef USE_HAT_FOR_DPAD
+#define KEYBOARD_WRONG_KEY( K) ( ( (K) > 0x67 && (K) < 0xe0) || (K) > 0xe7)
+#if KEYBOARD_WRONG_KEY( KEYBOARD_KEY_UP) || KEYBOARD_WRONG_KEY( KEYBOARD_KEY_DOWN) \
+ || KEYBOARD_WRONG_KEY( KEYBOARD_KEY_LEFT) || KEYBOARD_WRONG_KEY( KEYBOARD_KEY_RIGHT) \
+ || KEYBOARD_WRONG_KEY( KEYBOARD_KEY_SELECT) || KEYBOARD_WRONG_KEY( KEYBOARD_KEY_START) \
+ || KEYBOARD_WRONG_KEY( KEYBOARD_KEY_FIRE_1) || KEYBOARD_WRONG_KEY( KEYBOARD_KEY_FIRE_2) \
+ || KEYBOARD_WRONG_KEY( KEYBOARD_KEY_FIRE_3) || KEYBOARD_WRONG_KEY( KEYBOARD_KEY_FIRE_4) \
+ || KEYBOARD_WRONG_KEY( KEYBOARD_KEY_FIRE_5) || KEYBOARD_WRONG_KEY( KEYBOARD_KEY_FIRE_6) \
+ || KEYBOARD_WRONG_KEY( KEYBOARD_KEY_FIRE_7) || KEYBOARD_WRONG_KEY( KEYBOARD_KEY_FIRE_8) \
+ || KEYBOARD_WRONG_KEY( KEYBOARD_KEY_FIRE_9) || KEYBOARD_WRONG_KEY( KEYBOARD_KEY_FIRE_10)
+#error the keyboard keys must be in the 0x00-0x67 or 0xe0-0xe7 range
+#endif
+#elif OUTPUT_MODE != JOYSTICK
+#error unknown output mode
+#endif // OUTPUT_MODE
+
 #ifdef USE_HAT_FOR_DPAD
 #define HID_BUTTON_OFFSET_DPAD  4
 #define HID_BUTTON_PADDING_DPAD 0
@@ -147,6 +337,55 @@ void usb_pad_encoder_step();
 #define HID_AXIS_SNES           0
 #endif // ENABLE_SNES
 
+#ifdef ENABLE_JOYBUS
+#ifdef ENABLE_SNES
+#error the joybus and the snes protocols share the data pin, enable only one of them
+#endif
+#define JOYBUS_DATA_PIN  FULLSWITCH_FIRE_6_PIN
+#define HID_BUTTON_OFFSET_JOYBUS  0
+#define HID_BUTTON_PADDING_JOYBUS 0
+#define HID_AXIS_JOYBUS           6
+#else // ENABLE_JOYBUS
+#define HID_BUTTON_OFFSET_JOYBUS  0
+#define HID_BUTTON_PADDING_JOYBUS 0
+#define HID_AXIS_JOYBUS           0
+#endif // ENABLE_JOYBUS
+
+#ifdef ENABLE_PSX
+#if defined( ENABLE_SNES) || defined( ENABLE_SPINNER) || defined( ENABLE_ATARI_PADDLE)
+#error the psx protocol shares its pins with the snes, spinner and atari paddle ones, enable only one of them
+#endif
+// The first three are the hardware SPI pins of the 32u4
+#define PSX_COMMAND_PIN   FULLSWITCH_UP_PIN     // MOSI
+#define PSX_DATA_PIN      FULLSWITCH_LEFT_PIN   // MISO
+#define PSX_CLOCK_PIN     FULLSWITCH_FIRE_1_PIN // SCK
+#define PSX_ACK_PIN       FULLSWITCH_FIRE_7_PIN // It must have an interrupt
+// SS, that is also the RX led of the Arduino Micro: the USB core would change
+// it when data arrives on the serial, so do not send to the board while polling
+#define PSX_ATTENTION_PIN 17
+#define HID_BUTTON_OFFSET_PSX  0
+#define HID_BUTTON_PADDING_PSX 0
+#define HID_AXIS_PSX           8
+#else // ENABLE_PSX
+#define HID_BUTTON_OFFSET_PSX  0
+#define HID_BUTTON_PADDING_PSX 0
+#define HID_AXIS_PSX           0
+#endif // ENABLE_PSX
+
+#ifdef ENABLE_GENESIS
+#if defined( ENABLE_SPINNER) || defined( ENABLE_PSX) || defined( ENABLE_ATARI_PADDLE)
+#error the genesis protocol shares its pins with the spinner, psx and atari paddle ones, enable only one of them
+#endif
+// The Master System pins, plus SELECT
+#define GENESIS_UP_PIN     FULLSWITCH_UP_PIN
+#define GENESIS_DOWN_PIN   FULLSWITCH_DOWN_PIN
+#define GENESIS_LEFT_PIN   FULLSWITCH_LEFT_PIN
+#define GENESIS_RIGHT_PIN  FULLSWITCH_RIGHT_PIN
+#define GENESIS_TL_PIN     FULLSWITCH_FIRE_1_PIN
+#define GENESIS_TR_PIN     FULLSWITCH_FIRE_2_PIN
+#define GENESIS_SELECT_PIN FULLSWITCH_FIRE_3_PIN
+#endif // ENABLE_GENESIS
+
 #ifdef ENABLE_ATARI_PADDLE
 #define ATARI_PADDLE_FIRST_FIRE_PIN    FULLSWITCH_FIRE_1_PIN
 #define ATARI_PADDLE_FIRST_ANGLE_PIN   FULLSWITCH_FIRE_9_PIN
@@ -161,30 +400,99 @@ void usb_pad_encoder_step();
 #define HID_AXIS_ATARI_PADDLE 0
 #endif // ENABLE_ATARI_PADDLE
 
+#ifdef ENABLE_SPINNER
+// They must be pins with a pin-change or external interrupt
+#define SPINNER_A_PIN  FULLSWITCH_UP_PIN
+#define SPINNER_B_PIN  FULLSWITCH_DOWN_PIN
+#endif // ENABLE_SPINNER
+
 // These are needed to align the HID report fields to the gamepad_status_t ones
-#define HID_BUTTON_OFFSET  ( HID_BUTTON_OFFSET_DPAD + HID_BUTTON_OFFSET_SNES + HID_BUTTON_OFFSET_ATARI_PADDLE)
-#define HID_BUTTON_PADDING ( HID_BUTTON_PADDING_DPAD + HID_BUTTON_PADDING_SNES + HID_BUTTON_PADDING_ATARI_PADDLE)
-#define HID_AXIS           ( HID_AXIS_DPAD + HID_AXIS_SNES + HID_AXIS_ATARI_PADDLE)
+#define HID_BUTTON_OFFSET  ( HID_BUTTON_OFFSET_DPAD + HID_BUTTON_OFFSET_SNES + HID_BUTTON_OFFSET_JOYBUS + HID_BUTTON_OFFSET_PSX + HID_BUTTON_OFFSET_ATARI_PADDLE)
+#ifdef RUNTIME_SETTINGS
+// The full-switch buttons of the protocols disabled at runtime are used again
+#define HID_BUTTON_PADDING ( HID_BUTTON_PADDING_DPAD + HID_BUTTON_PADDING_JOYBUS + HID_BUTTON_PADDING_PSX)
+#else // RUNTIME_SETTINGS
+#define HID_BUTTON_PADDING ( HID_BUTTON_PADDING_DPAD + HID_BUTTON_PADDING_SNES + HID_BUTTON_PADDING_JOYBUS + HID_BUTTON_PADDING_PSX + HID_BUTTON_PADDING_ATARI_PADDLE)
+#endif // RUNTIME_SETTINGS
+#define HID_AXIS           ( HID_AXIS_DPAD + HID_AXIS_SNES + HID_AXIS_ATARI_PADDLE + HID_AXIS_JOYBUS + HID_AXIS_PSX)
+#if HID_AXIS > 8
+#error too many axis
+#endif
+
+// The paddle uses the first axis, the other protocols the following ones
+#define JOYBUS_AXIS        ( HID_AXIS_ATARI_PADDLE)
+#define PSX_AXIS           ( JOYBUS_AXIS + HID_AXIS_JOYBUS)
 #define HID_BUTTONS        ( 16 - HID_BUTTON_OFFSET - HID_BUTTON_PADDING)
 #if HID_BUTTONS < 0
 #error wrong button configuration
 #endif
 
+// Padding bytes of gamepad_status_t, declared also in the HID descriptor, so
+// the report layout does not depend on the alignment of the platform: the
+// axis start at an even byte, and the size needs no trailing padding
+#if defined( USE_HAT_FOR_DPAD) && HID_AXIS > 0
+#define HID_AXIS_ALIGN_PADDING 1
+#else
+#define HID_AXIS_ALIGN_PADDING 0
+#endif
+#if defined( ENABLE_SPINNER) && HID_AXIS > 0
+#define HID_TAIL_PADDING 1
+#else
+#define HID_TAIL_PADDING 0
+#endif
+
 #define NONE   1
 #define ASSIST 2
 #define TOGGLE 3
 
-// Generic routines and macros ----------------------------------------------------
+// The host tests set this to run all the stages at every step, to check that
+// the fast path does not change the result
+#ifndef FORCE_FULL_STEP
+#define FORCE_FULL_STEP 0
+#endif
+
+#ifdef RUNTIME_SETTINGS
+#if AUTOFIRE_MODE != NONE && AUTOFIRE_MODE != ASSIST && AUTOFIRE_MODE != TOGGLE
+#error "unsupported autofire mode"
+#endif
+// The value set at runtime, or the macro
+#define SETTING( CTX, FIELD, MACRO) ( (CTX)->plan.FIELD)
+#else // RUNTIME_SETTINGS
+#define SETTING( CTX, FIELD, MACRO) ( MACRO)
+#endif // RUNTIME_SETTINGS
+
+#if defined( ENABLE_ATARI_PADDLE) || defined( RUNTIME_SETTINGS)
+#define USE_STORAGE
+#endif
 
-static unsigned long now_us = 0;
-static void next_time_step(){ now_us = get_elasped_microsecond();}
-static unsigned long current_time_step(){ return now_us;}
+#ifdef DEBOUNCE_ADAPTIVE
+#if DEBOUNCE_MIN_PERIOD > DEBOUNCE_MAX_PERIOD || DEBOUNCE_MAX_PERIOD > 65535
+#error wrong debounce configuration
+#endif
+#endif // DEBOUNCE_ADAPTIVE
+
+#define DEBOUNCE_SLOTS 18
+
+// Generic routines and macros ----------------------------------------------------
 
 typedef struct{
   unsigned long time;
   char event;
 } timed_t;
 
+typedef struct{
+  unsigned long time; // of the last accepted change
+  char event;         // accepted value
+#ifdef DEBOUNCE_ADAPTIVE
+  char raw;           // last read value
+  char burst;         // a change was accepted and its bounce is being measured
+  char burst_event;   // value accepted at the start of the last burst
+  unsigned long burst_time;
+  uint16_t bounce;    // us // of the current burst
+  bounce_stat_t stat;
+#endif // DEBOUNCE_ADAPTIVE
+} debounce_t;
+
 typedef struct {
 
   uint8_t up:      1;
@@ -226,16 +534,276 @@ typedef struct {
   uint8_t	unused1: 4;
 #endif
 
+#if HID_AXIS_ALIGN_PADDING > 0
+  uint8_t	unused2;
+#endif
+
 #if HID_AXIS > 0
   int16_t	axis[HID_AXIS];
 #endif // HID_AXIS
 
+#ifdef ENABLE_SPINNER
+  int8_t	spinner; // relative, steps since the last report
+#endif // ENABLE_SPINNER
+
+#if HID_TAIL_PADDING > 0
+  uint8_t	unused3;
+#endif
+
 } gamepad_status_t;
 
+#if OUTPUT_MODE == KEYBOARD || defined( RUNTIME_SETTINGS)
+// As the joystick HID descriptor, this relies on the bit fields being packed
+// from the least significant bit of the first byte
+static uint16_t gamepad_buttons( const gamepad_status_t* status){
+  const uint8_t* data = (const uint8_t*) status;
+  return data[ 0] | (uint16_t) data[ 1] << 8;
+}
+
+#endif // OUTPUT_MODE || RUNTIME_SETTINGS
+
+#if defined( RUNTIME_SETTINGS)
+static void gamepad_add_buttons( gamepad_status_t* status, uint16_t buttons){
+  uint8_t* data = (uint8_t*) status;
+  data[ 0] |= buttons;
+  data[ 1] |= buttons >> 8;
+}
+#endif // RUNTIME_SETTINGS
+
+#if defined( USE_STORAGE)
+typedef struct {
+  char pending;
+  uint8_t written;    // bytes of the record
+  unsigned long time; // of the next byte
+} storage_job_t;
+#endif // USE_STORAGE
+
+// Encoder context ----------------------------------------------------------------
+
+// The state of the protocols that keep it between the steps
+
+#if defined( ENABLE_JOYBUS)
+typedef struct {
+  uint8_t type;
+  uint8_t failures;
+  unsigned long next_poll;
+  uint8_t answer[ 8]; // last valid one
+} joybus_t;
+#endif // ENABLE_JOYBUS
+
+#define PSX_MAX_ANSWER    (21)     // bytes, with the pressures
+
+#if defined( ENABLE_PSX)
+typedef struct {
+  uint8_t state;
+  uint8_t clock;    // index in psx_clock
+  uint8_t sequence; // index in psx_sequence
+  uint8_t failures;
+  uint8_t position; // of the byte in the transfer
+  uint8_t length;   // of the transfer
+  unsigned long byte_time;
+  unsigned long next_transfer;
+  uint8_t answer[ PSX_MAX_ANSWER];
+  uint8_t last[ PSX_MAX_ANSWER]; // last valid poll answer, 0 if none
+} psx_t;
+#endif // ENABLE_PSX
+
+#if defined( ENABLE_ATARI_PADDLE)
+typedef struct {
+  int16_t min;  // raw // observed range, empty if min > max
+  int16_t max;  // raw
+  int16_t base; // raw // start of the table, the range is stretched if too narrow
+  uint32_t scale; // table segments per raw unit, 16.16 fixed point
+  uint32_t low;   // linearized base
+  uint32_t full;  // linearized span, scaled down to 16 bit
+  uint8_t shift;  // of the scale down
+  uint8_t built;  // table entries up to date
+  int16_t table[ ATARI_PADDLE_TABLE_SIZE +1]; // HID value at the segment ends
+} paddle_axis_t;
+
+typedef struct {
+  paddle_axis_t axis[ 2];
+  storage_job_t save;
+} paddle_t;
+#endif // ENABLE_ATARI_PADDLE
+
+#if defined( ENABLE_GENESIS)
+typedef struct {
+  unsigned long next_read;
+  uint8_t six_button;
+  gamepad_status_t last;
+} genesis_t;
+#endif // ENABLE_GENESIS
+
+#if defined( RUNTIME_SETTINGS)
+typedef void (*stage_t)( usb_pad_encoder_t* ctx, gamepad_status_t* gamepad);
+typedef int (*autofire_t)( usb_pad_encoder_t* ctx, timed_t* last, int is_pressed, int option);
+
+typedef struct {
+  uint8_t pin;
+  uint8_t slot;  // debounce
+  uint16_t mask; // in gamepad_buttons
+} switch_plan_t;
+
+// The settings compiled for the step: just the enabled stages, the enabled
+// switches with their button masks, and the periods in us
+typedef struct {
+  stage_t read[ 7];
+  uint8_t read_count;
+  stage_t process[ 2];
+  uint8_t process_count;
+  switch_plan_t fullswitch[ 16];
+  uint8_t fullswitch_count;
+  autofire_t autofire;
+  uint16_t selector_mask;
+  uint8_t autofire_tap_count;
+  unsigned long tap_max_period;
+  unsigned long autofire_period;
+} plan_t;
+#endif // RUNTIME_SETTINGS
+
+struct usb_pad_encoder_s {
+  unsigned long now_us;        // of the current step
+  unsigned long wake_time;
+  char wake_pending;
+  gamepad_status_t old_status; // last sent
+  gamepad_status_t old_input;  // last read, before the processing
+  debounce_t debounce_slot[ DEBOUNCE_SLOTS];
+  timed_t autofire_slot[ 4];
+#if defined( ENABLE_ATARI_PADDLE)
+  int16_t first_axis_history[ 10];
+  int16_t second_axis_history[ 10];
+  paddle_t paddle;
+#endif // ENABLE_ATARI_PADDLE
+#if OUTPUT_MODE == KEYBOARD
+  uint16_t old_buttons;
+#endif // OUTPUT_MODE
+#if defined( ENABLE_JOYBUS)
+  joybus_t joybus;
+#endif // ENABLE_JOYBUS
+#if defined( ENABLE_PSX)
+  psx_t psx;
+#endif // ENABLE_PSX
+#if defined( ENABLE_GENESIS)
+  genesis_t genesis;
+#endif // ENABLE_GENESIS
+#if defined( RUNTIME_SETTINGS)
+  usb_pad_encoder_settings_t settings; // in use
+  usb_pad_encoder_settings_t received; // by the feature report, for the next step
+  volatile char settings_received;
+  storage_job_t settings_save;
+  plan_t plan;
+  uint16_t switch_accepted; // by the debounce, in gamepad_buttons bits
+  char switch_primed;
+#endif // RUNTIME_SETTINGS
+};
+
+// Used by the functions without the context
+static usb_pad_encoder_t default_context;
+
+size_t usb_pad_encoder_context_size( void){
+  return sizeof( usb_pad_encoder_t);
+}
+
+static void next_time_step( usb_pad_encoder_t* ctx){ ctx->now_us = get_elasped_microsecond();}
+static unsigned long current_time_step( usb_pad_encoder_t* ctx){ return ctx->now_us;}
+
+// The processing stages call these to be run again at a given time, also if no
+// input changes in the meanwhile (e.g. for the autofire timing)
+static void wake_at( usb_pad_encoder_t* ctx, unsigned long time){
+  if( !ctx->wake_pending || (long)( time - ctx->wake_time) < 0) ctx->wake_time = time;
+  ctx->wake_pending = 1;
+}
+static void wake_now( usb_pad_encoder_t* ctx){ wake_at( ctx, current_time_step( ctx));}
+static int wake_expired( usb_pad_encoder_t* ctx){ return ctx->wake_pending && (long)( current_time_step( ctx) - ctx->wake_time) >= 0;}
+
+// Wake at the next autofire switch, for a period started at the given time
+static void wake_at_next_period( usb_pad_encoder_t* ctx, unsigned long start){
+  const unsigned long period = SETTING( ctx, autofire_period, AUTOFIRE_PERIOD);
+  wake_at( ctx, start + (( current_time_step( ctx) - start) / period + 1) * period);
+}
+
+// Persistent storage -------------------------------------------------------------
+
+//
+// Some data is kept across the power cycles (e.g. in the EEPROM), through:
+//
+//   void storage_read( uint16_t address, void* data, uint16_t size);
+//   void storage_write( uint16_t address, const void* data, uint16_t size);
+//
+// They read and write the bytes at the given address. The write should skip
+// the bytes that do not change, to save the EEPROM wear. An EEPROM byte takes
+// some ms to be written, so the encoder writes a single byte at a time, and it
+// waits STORAGE_BYTE_WRITE_TIME before the next one: so storage_write can just
+// start the write, without waiting for its end.
+//
+
+#if defined( USE_STORAGE)
+
+// Start to save a record, after the given time
+static void storage_schedule( usb_pad_encoder_t* ctx, storage_job_t* job, unsigned long delay){
+  job->pending = 1;
+  job->written = 0;
+  job->time = current_time_step( ctx) + delay;
+}
+
+// Write the next byte of the record, if it is the time; it returns 1 when the
+// last one is written. The record can change between the calls, but then the
+// save must be scheduled again.
+static int storage_save( usb_pad_encoder_t* ctx, storage_job_t* job, uint16_t address, const void* record, uint8_t size){
+  if( !job->pending) return 0;
+  if( (long)( current_time_step( ctx) - job->time) >= 0){
+    storage_write( address + job->written, (const uint8_t*) record + job->written, 1);
+    job->written += 1;
+    job->time = current_time_step( ctx) + STORAGE_BYTE_WRITE_TIME;
+    if( job->written >= size) job->pending = 0;
+  }
+  if( job->pending) wake_at( ctx, job->time);
+  return !job->pending;
+}
+
+#endif // USE_STORAGE
+
 // USB HID wrapper ----------------------------------------------------------------
 
 #define HID_REPORT_ID (0x06)
 
+#ifdef RUNTIME_SETTINGS
+#define SETTINGS_HID_DESCRIPTOR \
+    /* Settings, see usb_pad_encoder_settings_t */ \
+    0x85, SETTINGS_REPORT_ID, /*    REPORT_ID */ \
+    0x06, 0x00, 0xff,         /*    USAGE_PAGE (Vendor Defined Page 1) */ \
+    0x09, 0x01,               /*    USAGE (Vendor Usage 1) */ \
+    0x15, 0x00,               /*    LOGICAL_MINIMUM (0) */ \
+    0x26, 0xff, 0x00,         /*    LOGICAL_MAXIMUM (255) */ \
+    0x75, 0x08,               /*    REPORT_SIZE (8) */ \
+    0x95, sizeof( usb_pad_encoder_settings_t), /* REPORT_COUNT */ \
+    0xb1, 0x02,               /*    FEATURE (Data,Var,Abs) */
+#else // RUNTIME_SETTINGS
+#define SETTINGS_HID_DESCRIPTOR
+#endif // RUNTIME_SETTINGS
+
+#ifdef DEBOUNCE_ADAPTIVE
+// 12 = sizeof( bounce_stat_t), the report count is a byte
+#if BOUNCE_SWITCHES != DEBOUNCE_SLOTS || BOUNCE_SWITCHES * 12 > 255
+#error wrong bounce report size
+#endif
+#define BOUNCE_HID_DESCRIPTOR \
+    /* Bounce statistics, see usb_pad_encoder_get_bounce_report */ \
+    0x85, BOUNCE_REPORT_ID,   /*    REPORT_ID */ \
+    0x06, 0x00, 0xff,         /*    USAGE_PAGE (Vendor Defined Page 1) */ \
+    0x09, 0x02,               /*    USAGE (Vendor Usage 2) */ \
+    0x15, 0x00,               /*    LOGICAL_MINIMUM (0) */ \
+    0x26, 0xff, 0x00,         /*    LOGICAL_MAXIMUM (255) */ \
+    0x75, 0x08,               /*    REPORT_SIZE (8) */ \
+    0x95, BOUNCE_SWITCHES * sizeof( bounce_stat_t), /* REPORT_COUNT */ \
+    0xb1, 0x03,               /*    FEATURE (Cnst,Var,Abs) */
+#else // DEBOUNCE_ADAPTIVE
+#define BOUNCE_HID_DESCRIPTOR
+#endif // DEBOUNCE_ADAPTIVE
+
+#if OUTPUT_MODE == JOYSTICK
+
 // The content of this array must match the definition of gamepad_status_t.
 static const uint8_t gamepad_hid_descriptor[] HID_DESCRIPTOR_ATTRIBUTE = {
 
@@ -283,6 +851,17 @@ static const uint8_t gamepad_hid_descriptor[] HID_DESCRIPTOR_ATTRIBUTE = {
     // 0x65, 0x14,             //    Unit: English Rotation/Angular Position 1 degree (Optional)
     // 0x81, 0x42,             //    INPUT (Data, Var, Abs, Null State)
     0x81, 0x02,             //    INPUT (Data,Var,Abs)
+    // Mask the rest of the byte
+    0x95, 0x01,             //    REPORT_COUNT (1)
+    0x75, 0x04,             //    REPORT_SIZE (4)
+    0x81, 0x03,             //    INPUT (Cnst,Var,Abs)
+#endif
+
+#if HID_AXIS_ALIGN_PADDING > 0
+    // Align the axis
+    0x75, 0x08,                   //    REPORT_SIZE (8)
+    0x95, HID_AXIS_ALIGN_PADDING, //    REPORT_COUNT (N = HID_AXIS_ALIGN_PADDING)
+    0x81, 0x03,                   //    INPUT (Cnst,Var,Abs)
 #endif
 
 #if HID_AXIS > 0
@@ -298,6 +877,18 @@ static const uint8_t gamepad_hid_descriptor[] HID_DESCRIPTOR_ATTRIBUTE = {
 #endif
 #if HID_AXIS > 3
     0x09, 0x34,             //    USAGE (Ry)
+#endif
+#if HID_AXIS > 4
+    0x09, 0x32,             //    USAGE (Z)
+#endif
+#if HID_AXIS > 5
+    0x09, 0x35,             //    USAGE (Rz)
+#endif
+#if HID_AXIS > 6
+    0x09, 0x36,             //    USAGE (Slider)
+#endif
+#if HID_AXIS > 7
+    0x09, 0x38,             //    USAGE (Wheel)
 #endif
       0x16, 0x00, 0x80,     //      LOGICAL_MINIMUM (-32768)
       0x26, 0xFF, 0x7F,     //      LOGICAL_MAXIMUM (32767)
@@ -306,6 +897,24 @@ static const uint8_t gamepad_hid_descriptor[] HID_DESCRIPTOR_ATTRIBUTE = {
     0x81, 0x02,             //    INPUT (Data,Var,Abs)
 #endif
 
+#ifdef ENABLE_SPINNER
+    // 8bit Relative axis
+    0x05, 0x01,             //    USAGE_PAGE (Generic Desktop)
+    0x09, 0x37,             //    USAGE (Dial)
+      0x15, 0x81,           //      LOGICAL_MINIMUM (-127)
+      0x25, 0x7F,           //      LOGICAL_MAXIMUM (127)
+    0x75, 0x08,             //    REPORT_SIZE (8)
+    0x95, 0x01,             //    REPORT_COUNT (1)
+    0x81, 0x06,             //    INPUT (Data,Var,Rel)
+#endif
+
+#if HID_TAIL_PADDING > 0
+    // Fill the last axis word
+    0x75, 0x08,             //    REPORT_SIZE (8)
+    0x95, HID_TAIL_PADDING, //    REPORT_COUNT (N = HID_TAIL_PADDING)
+    0x81, 0x03,             //    INPUT (Cnst,Var,Abs)
+#endif
+
 /*
     // 2 8bit Axis
     0x09, 0x32,             //    USAGE (Z)
@@ -318,19 +927,112 @@ static const uint8_t gamepad_hid_descriptor[] HID_DESCRIPTOR_ATTRIBUTE = {
     0xc0,                   //    END_COLLECTION
 */
 
+  SETTINGS_HID_DESCRIPTOR
+  BOUNCE_HID_DESCRIPTOR
+
+  0xc0                      //  END_COLLECTION
+};
+
+#endif // OUTPUT_MODE
+
+#if OUTPUT_MODE == KEYBOARD
+
+// The keys are a bitmap, so all of them can be pressed together (N-key
+// rollover), while the boot report, e.g. the one of the Arduino Keyboard
+// library, has room for 6 keys only. The first byte has the modifiers
+// 0xe0-0xe7, then there is one bit for each of the keys 0x00-0x67.
+#define KEYBOARD_REPORT_SIZE ( 1 + 0x68 / 8)
+
+static const uint8_t keyboard_hid_descriptor[] HID_DESCRIPTOR_ATTRIBUTE = {
+
+  0x05, 0x01,               //  USAGE_PAGE (Generic Desktop)
+  0x09, 0x06,               //  USAGE (Keyboard)
+  0xa1, 0x01,               //  COLLECTION (Application)
+    0x85, HID_REPORT_ID,    //    REPORT_ID
+
+    // Modifiers
+    0x05, 0x07,             //    USAGE_PAGE (Keyboard)
+      0x19, 0xe0,           //      USAGE_MINIMUM (Left Control)
+      0x29, 0xe7,           //      USAGE_MAXIMUM (Right GUI)
+    0x15, 0x00,             //    LOGICAL_MINIMUM (0)
+    0x25, 0x01,             //    LOGICAL_MAXIMUM (1)
+    0x75, 0x01,             //    REPORT_SIZE (1)
+    0x95, 0x08,             //    REPORT_COUNT (8)
+    0x81, 0x02,             //    INPUT (Data,Var,Abs)
+
+    // Key bitmap
+      0x19, 0x00,           //      USAGE_MINIMUM (0)
+      0x29, 0x67,           //      USAGE_MAXIMUM (Keypad =)
+    0x75, 0x01,             //    REPORT_SIZE (1)
+    0x95, 0x68,             //    REPORT_COUNT (104)
+    0x81, 0x02,             //    INPUT (Data,Var,Abs)
+
+  SETTINGS_HID_DESCRIPTOR
+  BOUNCE_HID_DESCRIPTOR
+
   0xc0                      //  END_COLLECTION
 };
 
+// The same order of the buttons of gamepad_status_t
+static const uint8_t keyboard_key_map[ 16] = {
+  KEYBOARD_KEY_UP, KEYBOARD_KEY_DOWN, KEYBOARD_KEY_LEFT, KEYBOARD_KEY_RIGHT,
+  KEYBOARD_KEY_SELECT, KEYBOARD_KEY_START,
+  KEYBOARD_KEY_FIRE_1, KEYBOARD_KEY_FIRE_2, KEYBOARD_KEY_FIRE_3,
+  KEYBOARD_KEY_FIRE_4, KEYBOARD_KEY_FIRE_5,
+#if !defined( ENABLE_SNES)
+  KEYBOARD_KEY_FIRE_6, KEYBOARD_KEY_FIRE_7, KEYBOARD_KEY_FIRE_8,
+#endif
+#if !defined( ENABLE_ATARI_PADDLE)
+  KEYBOARD_KEY_FIRE_9, KEYBOARD_KEY_FIRE_10,
+#endif
+#if defined( ENABLE_SNES)
+  KEYBOARD_KEY_FIRE_6, KEYBOARD_KEY_FIRE_7, KEYBOARD_KEY_FIRE_8,
+#endif
+#if defined( ENABLE_ATARI_PADDLE)
+  KEYBOARD_KEY_FIRE_9, KEYBOARD_KEY_FIRE_10,
+#endif
+};
+
+// The same work for any number of pressed buttons: every button sets its bit,
+// pressed or not
+static void keyboard_report( uint16_t buttons, uint8_t* report){
+  memset( report, 0, KEYBOARD_REPORT_SIZE);
+  for( int k = 0; k < 16; k += 1){
+    uint8_t key = keyboard_key_map[ k];
+    uint8_t index = key >= 0xe0 ? 0 : 1 + ( key >> 3);
+    report[ index] |= ( ( buttons >> k) & 1) << ( key & 7);
+  }
+  report[ 1] &= ~1; // The key 0, i.e. no key
+}
+
+static void keyboard_send( usb_pad_encoder_t* ctx, gamepad_status_t* status){
+  uint16_t buttons = gamepad_buttons( status);
+  if( buttons == ctx->old_buttons) return;
+  ctx->old_buttons = buttons;
+
+  uint8_t report[ KEYBOARD_REPORT_SIZE];
+  keyboard_report( buttons, report);
+  send_hid_report( HID_REPORT_ID, report, sizeof( report));
+  LOG(1, "keyboard report buttons %04x : %lu %lu", buttons,
+      get_elasped_microsecond() - current_time_step( ctx), current_time_step( ctx));
+}
+
+#endif // OUTPUT_MODE
+
 void config_log(){
+#if OUTPUT_MODE == KEYBOARD
+  LOG(1, "configuration report id: %d | keyboard keys: %d", HID_REPORT_ID, 16);
+#else // OUTPUT_MODE
   int hat = 0;
 #ifdef USE_HAT_FOR_DPAD
   hat = 1;
 #endif
   LOG(1, "configuration report id: %d | button: %d # hat: %d > axis: %d @ offset/padding: %d/%d",
       HID_REPORT_ID, HID_BUTTONS, hat, HID_AXIS, HID_BUTTON_OFFSET, HID_BUTTON_PADDING);
+#endif // OUTPUT_MODE
 }
 
-void gamepad_log(void* data){
+void gamepad_log( usb_pad_encoder_t* ctx, void* data){
   gamepad_status_t* status = (gamepad_status_t*) data;
   config_log();
   LOG(1, "gamepad report state "
@@ -345,6 +1047,9 @@ void gamepad_log(void* data){
 #endif
 #if HID_AXIS > 0
       "> %d %d "
+#endif
+#ifdef ENABLE_SPINNER
+      "~ %d "
 #endif
       ": %lu %lu",
 
@@ -360,19 +1065,38 @@ void gamepad_log(void* data){
 #if HID_AXIS > 0
       status->axis[0], status->axis[1],
 #endif
-      get_elasped_microsecond() - current_time_step(), current_time_step()
+#ifdef ENABLE_SPINNER
+      status->spinner,
+#endif
+      get_elasped_microsecond() - current_time_step( ctx), current_time_step( ctx)
    );
 }
 
 void gamepad_init(){
 
+#if OUTPUT_MODE == KEYBOARD
+  use_hid_descriptor(keyboard_hid_descriptor, sizeof(keyboard_hid_descriptor));
+#else // OUTPUT_MODE
   use_hid_descriptor(gamepad_hid_descriptor, sizeof(gamepad_hid_descriptor));
+#endif // OUTPUT_MODE
 }
 
-void gamepad_send(gamepad_status_t *status){
+static int gamepad_has_relative(gamepad_status_t *status){
+  (void) status;
+#ifdef ENABLE_SPINNER
+  if( status->spinner) return 1;
+#endif
+  return 0;
+}
 
+void gamepad_send( usb_pad_encoder_t* ctx, gamepad_status_t *status){
+
+#if OUTPUT_MODE == KEYBOARD
+  keyboard_send( ctx, status);
+#else // OUTPUT_MODE
   send_hid_report( HID_REPORT_ID, status, sizeof(*status));
-  gamepad_log( status);
+  gamepad_log( ctx, status);
+#endif // OUTPUT_MODE
 }
 
 // Common input-related routines --------------------------------------------------
@@ -399,28 +1123,129 @@ static void process_dpad( gamepad_status_t* gamepad){
 #endif // USE_HAT_FOR_DPAD
 }
 
-static int button_debounce(timed_t* last, int current) {
+#ifdef DEBOUNCE_ADAPTIVE
+// The raw changes after an accepted one are considered bounce until the switch
+// is quiet for DEBOUNCE_MIN_PERIOD, also the ones outside the debounce window
+// (i.e. the window was too short). Then the window is fitted to the bounce.
+static void bounce_profile( usb_pad_encoder_t* ctx, debounce_t* last, int current) {
+
+  const unsigned long now = current_time_step( ctx);
+
+  if( last->burst && current != last->raw){
+    unsigned long bounce = now - last->burst_time;
+    if( bounce < DEBOUNCE_MAX_PERIOD && bounce > last->bounce) last->bounce = bounce;
+  }
+  last->raw = current;
+
+  if( last->burst && ( now - last->burst_time >= DEBOUNCE_MAX_PERIOD
+                    || now - last->burst_time - last->bounce >= DEBOUNCE_MIN_PERIOD)){
+    bounce_stat_t* stat = &last->stat;
+    last->burst = 0;
+
+    stat->changes += 1;
+    if( last->bounce > 0) stat->bounced += 1;
+    if( last->bounce > stat->max_bounce) stat->max_bounce = last->bounce;
+
+    // Follow the peaks at once, but forget them slowly
+    if( last->bounce > stat->estimate) stat->estimate = last->bounce;
+    else stat->estimate -= ( stat->estimate - last->bounce) >> 3;
+
+    unsigned long window = stat->estimate + DEBOUNCE_MARGIN;
+    if( window < DEBOUNCE_MIN_PERIOD) window = DEBOUNCE_MIN_PERIOD;
+    if( window > DEBOUNCE_MAX_PERIOD) window = DEBOUNCE_MAX_PERIOD;
+    stat->window = window;
+
+    LOG( window == DEBOUNCE_MAX_PERIOD, "switch worn out: bounce/%u max/%u", last->bounce, stat->max_bounce);
+  }
+}
+
+static void bounce_accept( usb_pad_encoder_t* ctx, debounce_t* last, int current) {
+
+  if( last->burst){
+    // The window was too short for this switch
+    if( current != last->burst_event) last->stat.glitches += 1;
+
+  } else if( current != last->burst_event){
+    last->burst = 1;
+    last->burst_event = current;
+    last->burst_time = current_time_step( ctx);
+    last->bounce = 0;
+  }
+  // Otherwise it is the end of a glitch that lasted after the burst
+}
+#endif // DEBOUNCE_ADAPTIVE
+
+static int button_debounce( usb_pad_encoder_t* ctx, debounce_t* last, int current) {
 
-  const unsigned long now = current_time_step();
+  const unsigned long now = current_time_step( ctx);
 
   if( last->time == 0){
     // Debounce initialization
     last->time = now;
     last->event = current;
+#ifdef DEBOUNCE_ADAPTIVE
+    last->raw = current;
+    last->burst_event = current;
+    last->stat.window = DEBOUNCE_PERIOD;
+#endif // DEBOUNCE_ADAPTIVE
+    return current;
+  }
+
+#ifdef DEBOUNCE_ADAPTIVE
+  bounce_profile( ctx, last, current);
+  const unsigned long window = last->stat.window;
+#else // DEBOUNCE_ADAPTIVE
+  const unsigned long window = DEBOUNCE_PERIOD;
+#endif // DEBOUNCE_ADAPTIVE
 
-  } else if( now - last->time < 5000 /*us*/){
-    // Mask unwanted bounce
+  if( now - last->time < window){
+    // Mask unwanted bounce; a change is read again at the end of the window
+    if( current != last->event) wake_at( ctx, last->time + window);
     current = last->event;
 
   } else {
     // Debouncing passed, keep the new value
-    if(last->event != current) last->time = now;
+    if(last->event != current){
+      last->time = now;
+#ifdef DEBOUNCE_ADAPTIVE
+      bounce_accept( ctx, last, current);
+#endif // DEBOUNCE_ADAPTIVE
+    }
     last->event = current;
   }
   return current;
 }
 
-static int16_t moving_average(int16_t* buffer, int16_t size, int16_t newval){
+#ifdef DEBOUNCE_ADAPTIVE
+int usb_pad_encoder_bounce_stat_context( usb_pad_encoder_t* ctx, int index, bounce_stat_t* stat){
+  if( index < 0 || index >= DEBOUNCE_SLOTS) return 0;
+  if( ctx->debounce_slot[ index].time == 0) return 0;
+  *stat = ctx->debounce_slot[ index].stat;
+  return 1;
+}
+
+int usb_pad_encoder_bounce_stat( int index, bounce_stat_t* stat){
+  return usb_pad_encoder_bounce_stat_context( &default_context, index, stat);
+}
+
+int usb_pad_encoder_get_bounce_report_context( usb_pad_encoder_t* ctx, uint8_t* report, int size){
+  const int result = BOUNCE_SWITCHES * sizeof( bounce_stat_t);
+  if( size < result) return -1;
+  for( int k = 0; k < BOUNCE_SWITCHES; k += 1){
+    bounce_stat_t stat;
+    if( !usb_pad_encoder_bounce_stat_context( ctx, k, &stat)) memset( &stat, 0, sizeof( stat));
+    memcpy( report + k * sizeof( stat), &stat, sizeof( stat));
+  }
+  return result;
+}
+
+int usb_pad_encoder_get_bounce_report( uint8_t* report, int size){
+  return usb_pad_encoder_get_bounce_report_context( &default_context, report, size);
+}
+#endif // DEBOUNCE_ADAPTIVE
+
+#if defined( ENABLE_ATARI_PADDLE)
+static int16_t moving_average( usb_pad_encoder_t* ctx, int16_t* buffer, int16_t size, int16_t newval){
 
   int16_t* index = buffer;    // The fist item is the index to the oldest inserted value
   int16_t* value = buffer +1; // The other items are the last N read values
@@ -433,18 +1258,32 @@ static int16_t moving_average(int16_t* buffer, int16_t size, int16_t newval){
 
   // Calculate the average
   int result = 0;
-  for(int k = 0; k < n; k += 1) result += value[k];
+  int settled = 1;
+  for(int k = 0; k < n; k += 1){
+    result += value[k];
+    if( value[k] != newval) settled = 0;
+  }
   result /= n;
+
+  // The average will change also if the next values are the same
+  if( !settled) wake_now( ctx);
+
   return result;
 }
+#endif // ENABLE_ATARI_PADDLE
 
 // Autofire -----------------------------------------------------------------------
 
-static int autofire_none( timed_t* last, int is_pressed, int option){
+#if !defined( RUNTIME_SETTINGS) && AUTOFIRE_MODE == NONE
+static int autofire_none( usb_pad_encoder_t* ctx, timed_t* last, int is_pressed, int option){
+  (void) ctx; (void) last; (void) option;
   return is_pressed;
 }
+#endif // RUNTIME_SETTINGS, AUTOFIRE_MODE
 
-static int autofire_assist( timed_t* last, int is_pressed, int option){
+#if defined( RUNTIME_SETTINGS) || AUTOFIRE_MODE == ASSIST
+static int autofire_assist( usb_pad_encoder_t* ctx, timed_t* last, int is_pressed, int option){
+  (void) option;
 
   unsigned long last_time = last->time;
   int last_pressed = last->event & 0x1;
@@ -455,50 +1294,59 @@ static int autofire_assist( timed_t* last, int is_pressed, int option){
   int was_pressed = last_pressed; // TODO : clean up this
   last_pressed = is_pressed; // TODO : clean up this
   if (is_pressed && !was_pressed) {
-    last_time = current_time_step();
+    last_time = current_time_step( ctx);
   }
 
   // count the number of taps
   if (is_pressed && !was_pressed) {
-    if (current_time_step() < press_time + TAP_MAX_PERIOD ) {
+    if (current_time_step( ctx) < press_time + SETTING( ctx, tap_max_period, TAP_MAX_PERIOD) ) {
       tap_count += 1;
     }
   }
  
   // reset tap count if too much time is elapsed
-  if (!is_pressed && current_time_step() >= press_time + TAP_MAX_PERIOD ) {
+  if (!is_pressed && current_time_step( ctx) >= press_time + SETTING( ctx, tap_max_period, TAP_MAX_PERIOD) ) {
     tap_count = 0;
   }
   
   // do autofire 
-  if ( is_pressed &&( tap_count >= AUTOFIRE_TAP_COUNT)){
-    is_pressed = !((( current_time_step() - press_time) / AUTOFIRE_PERIOD) % 2);
+  if ( is_pressed &&( tap_count >= SETTING( ctx, autofire_tap_count, AUTOFIRE_TAP_COUNT))){
+    is_pressed = !((( current_time_step( ctx) - press_time) / SETTING( ctx, autofire_period, AUTOFIRE_PERIOD)) % 2);
   }
  
-  LOG( is_pressed != was_pressed, "auto fire status: count/%d current/%d timing/%ld result/%d", tap_count, is_pressed, current_time_step() - press_time, is_pressed);
+  LOG( is_pressed != was_pressed, "auto fire status: count/%d current/%d timing/%ld result/%d", tap_count, is_pressed, current_time_step( ctx) - press_time, is_pressed);
+
+  // time-driven changes of the next iterations
+  if( last_pressed && tap_count >= SETTING( ctx, autofire_tap_count, AUTOFIRE_TAP_COUNT)) wake_at_next_period( ctx, last_time);
+  if( !last_pressed && tap_count > 0) wake_at( ctx, last_time + SETTING( ctx, tap_max_period, TAP_MAX_PERIOD));
 
   last->time = last_time;
   last->event = (!! last_pressed) +( tap_count << 1);
 
   return is_pressed;
 }
+#endif // RUNTIME_SETTINGS, AUTOFIRE_MODE
 
-static int autofire_toggle( timed_t* last, int is_pressed, int is_toggled){
+#if defined( RUNTIME_SETTINGS) || AUTOFIRE_MODE == TOGGLE
+static int autofire_toggle( usb_pad_encoder_t* ctx, timed_t* last, int is_pressed, int is_toggled){
 
   unsigned long last_time = last->time;
   int last_toggle = last->event & 0x1;
   int autofire_enabled = last->event & 0x2;
+  int was_pressed = last->event & 0x4;
 
   // store current status for the next iterations
   int was_toggled = last_toggle; // TODO : clean up
   last_toggle = is_toggled; // TODO : clean up
-  unsigned long press_time = last_time; // TODO : clean up
   int autofire = autofire_enabled; // TODO : clean up
 
+  int last_pressed = is_pressed;
+
   // store the press time
-  if (!is_pressed) {
-    last_time = current_time_step(); // + 1;
+  if (is_pressed && !was_pressed) {
+    last_time = current_time_step( ctx);
   }
+  unsigned long press_time = last_time;
 
   // flip the toggle when the toggle-button is press and released while the target-button is pressed
   if (was_toggled && !is_toggled && is_pressed) {
@@ -507,39 +1355,48 @@ static int autofire_toggle( timed_t* last, int is_pressed, int is_toggled){
 
   // do autofire
   if (autofire && is_pressed) {
-    is_pressed = !(((current_time_step() - press_time) / AUTOFIRE_PERIOD ) % 2);
+    is_pressed = !(((current_time_step( ctx) - press_time) / SETTING( ctx, autofire_period, AUTOFIRE_PERIOD) ) % 2);
   }
 
-  LOG(is_toggled != was_toggled, "auto fire status: auto/%d current/%d timing/%ld result/%d", autofire, is_pressed, current_time_step() - press_time, is_pressed);
+  LOG(is_toggled != was_toggled, "auto fire status: auto/%d current/%d timing/%ld result/%d", autofire, is_pressed, current_time_step( ctx) - press_time, is_pressed);
+
+  // time-driven changes of the next iterations
+  if( autofire_enabled && last_pressed) wake_at_next_period( ctx, last_time);
 
   last->time = last_time;
-  last->event = (!! last_toggle) +((!! autofire_enabled) << 1);
+  last->event = (!! last_toggle) +((!! autofire_enabled) << 1) +((!! last_pressed) << 2);
 
   return is_pressed;
 }
+#endif // RUNTIME_SETTINGS, AUTOFIRE_MODE
 
 // autofire mode selection
 //
-static int do_autofire( timed_t* last, int is_pressed, int option){
-#if AUTOFIRE_MODE == NONE
-  return autofire_none( last, is_pressed, option);
+static int do_autofire( usb_pad_encoder_t* ctx, timed_t* last, int is_pressed, int option){
+#if defined( RUNTIME_SETTINGS)
+  return ctx->plan.autofire( ctx, last, is_pressed, option);
+#elif AUTOFIRE_MODE == NONE
+  return autofire_none( ctx, last, is_pressed, option);
 #elif AUTOFIRE_MODE == ASSIST
-  return autofire_assist( last, is_pressed, option);
+  return autofire_assist( ctx, last, is_pressed, option);
 #elif AUTOFIRE_MODE == TOGGLE
-  return autofire_toggle( last, is_pressed, option);
+  return autofire_toggle( ctx, last, is_pressed, option);
 #else
   #error "unsupported autofire mode"
   return -1;
 #endif
 }
 
-static void process_autofire( gamepad_status_t* gamepad) {
-  static timed_t autofire_slot[ 4] = { 0};
-
-  gamepad->fire1 = do_autofire( autofire_slot + 0, gamepad->fire1, gamepad->AUTOFIRE_SELECTOR);
-  gamepad->fire2 = do_autofire( autofire_slot + 1, gamepad->fire2, gamepad->AUTOFIRE_SELECTOR);
-  gamepad->fire3 = do_autofire( autofire_slot + 2, gamepad->fire3, gamepad->AUTOFIRE_SELECTOR);
-  gamepad->fire4 = do_autofire( autofire_slot + 3, gamepad->fire4, gamepad->AUTOFIRE_SELECTOR);
+static void process_autofire( usb_pad_encoder_t* ctx, gamepad_status_t* gamepad) {
+#if defined( RUNTIME_SETTINGS)
+  const int option = !!( gamepad_buttons( gamepad) & ctx->plan.selector_mask);
+#else // RUNTIME_SETTINGS
+  const int option = gamepad->AUTOFIRE_SELECTOR;
+#endif // RUNTIME_SETTINGS
+  gamepad->fire1 = do_autofire( ctx, ctx->autofire_slot + 0, gamepad->fire1, option);
+  gamepad->fire2 = do_autofire( ctx, ctx->autofire_slot + 1, gamepad->fire2, option);
+  gamepad->fire3 = do_autofire( ctx, ctx->autofire_slot + 2, gamepad->fire3, option);
+  gamepad->fire4 = do_autofire( ctx, ctx->autofire_slot + 3, gamepad->fire4, option);
 }
 
 // SwitchFull protocol ------------------------------------------------------------
@@ -622,23 +1479,40 @@ static void process_autofire( gamepad_status_t* gamepad) {
 // . = not used for player controls
 //
 
-static void setup_fullswitch(void){
+static void setup_fullswitch( usb_pad_encoder_t* ctx){
+  (void) ctx;
 #if defined(ENABLE_FULLSWITCH)
 
+#if !defined( ENABLE_SPINNER) && !defined( ENABLE_PSX) && !defined( ENABLE_GENESIS)
   setup_input( FULLSWITCH_UP_PIN, 1);
+#endif // ENABLE_SPINNER, ENABLE_PSX, ENABLE_GENESIS
+#if !defined( ENABLE_SPINNER) && !defined( ENABLE_GENESIS)
   setup_input( FULLSWITCH_DOWN_PIN, 1);
+#endif // ENABLE_SPINNER, ENABLE_GENESIS
+#if !defined( ENABLE_PSX) && !defined( ENABLE_GENESIS)
   setup_input( FULLSWITCH_LEFT_PIN, 1);
+#endif // ENABLE_PSX, ENABLE_GENESIS
+#if !defined( ENABLE_GENESIS)
   setup_input( FULLSWITCH_RIGHT_PIN, 1);
+#endif // ENABLE_GENESIS
   setup_input( FULLSWITCH_SELECT_PIN, 1);
   setup_input( FULLSWITCH_COIN_PIN, 1);
+#if !defined( ENABLE_PSX) && !defined( ENABLE_GENESIS)
   setup_input( FULLSWITCH_FIRE_1_PIN, 1);
+#endif // ENABLE_PSX, ENABLE_GENESIS
+#if !defined( ENABLE_GENESIS)
   setup_input( FULLSWITCH_FIRE_2_PIN, 1);
   setup_input( FULLSWITCH_FIRE_3_PIN, 1);
+#endif // ENABLE_GENESIS
   setup_input( FULLSWITCH_FIRE_4_PIN, 1);
   setup_input( FULLSWITCH_FIRE_5_PIN, 1);
-#if !defined( ENABLE_SNES)
+#if !defined( ENABLE_SNES) && !defined( ENABLE_JOYBUS)
   setup_input( FULLSWITCH_FIRE_6_PIN, 1);
+#endif // ENABLE_SNES, ENABLE_JOYBUS
+#if !defined( ENABLE_SNES) && !defined( ENABLE_PSX)
   setup_input( FULLSWITCH_FIRE_7_PIN, 1);
+#endif // ENABLE_SNES, ENABLE_PSX
+#if !defined( ENABLE_SNES)
   setup_input( FULLSWITCH_FIRE_8_PIN, 1);
 #endif // ENABLE_SNES
 #if !defined( ENABLE_ATARI_PADDLE)
@@ -649,25 +1523,39 @@ static void setup_fullswitch(void){
 }
 
 
-static void read_fullswitch( gamepad_status_t* gamepad) {
+static void read_fullswitch( usb_pad_encoder_t* ctx, gamepad_status_t* gamepad) {
 #if defined( ENABLE_FULLSWITCH)
-  static timed_t debounce_slot[ 16] = { 0};
-
-#define RDD( I, P) button_debounce( debounce_slot + (I), !read_digital( P ))
+#define RDD( I, P) button_debounce( ctx, ctx->debounce_slot + (I), !read_digital( P ))
+#if !defined( ENABLE_SPINNER) && !defined( ENABLE_PSX) && !defined( ENABLE_GENESIS)
   gamepad->up |=    RDD( 0, FULLSWITCH_UP_PIN);
+#endif // ENABLE_SPINNER, ENABLE_PSX, ENABLE_GENESIS
+#if !defined( ENABLE_SPINNER) && !defined( ENABLE_GENESIS)
   gamepad->down |=  RDD( 1, FULLSWITCH_DOWN_PIN);
+#endif // ENABLE_SPINNER, ENABLE_GENESIS
+#if !defined( ENABLE_PSX) && !defined( ENABLE_GENESIS)
   gamepad->left |=  RDD( 2, FULLSWITCH_LEFT_PIN);
+#endif // ENABLE_PSX, ENABLE_GENESIS
+#if !defined( ENABLE_GENESIS)
   gamepad->right |= RDD( 3, FULLSWITCH_RIGHT_PIN);
+#endif // ENABLE_GENESIS
   gamepad->select|= RDD( 4, FULLSWITCH_SELECT_PIN);
   gamepad->start |= RDD( 5, FULLSWITCH_COIN_PIN);
+#if !defined( ENABLE_PSX) && !defined( ENABLE_GENESIS)
   gamepad->fire1 |= RDD( 6, FULLSWITCH_FIRE_1_PIN);
+#endif // ENABLE_PSX, ENABLE_GENESIS
+#if !defined( ENABLE_GENESIS)
   gamepad->fire2 |= RDD( 7, FULLSWITCH_FIRE_2_PIN);
   gamepad->fire3 |= RDD( 8, FULLSWITCH_FIRE_3_PIN);
+#endif // ENABLE_GENESIS
   gamepad->fire4 |= RDD( 9, FULLSWITCH_FIRE_4_PIN);
   gamepad->fire5 |= RDD( 10, FULLSWITCH_FIRE_5_PIN);
-#if !defined( ENABLE_SNES)
+#if !defined( ENABLE_SNES) && !defined( ENABLE_JOYBUS)
   gamepad->fire6 |= RDD( 11, FULLSWITCH_FIRE_6_PIN);
+#endif // ENABLE_SNES, ENABLE_JOYBUS
+#if !defined( ENABLE_SNES) && !defined( ENABLE_PSX)
   gamepad->fire7 |= RDD( 12, FULLSWITCH_FIRE_7_PIN);
+#endif // ENABLE_SNES, ENABLE_PSX
+#if !defined( ENABLE_SNES)
   gamepad->fire8 |= RDD( 13, FULLSWITCH_FIRE_8_PIN);
 #endif // ENABLE_SNES
 #if !defined( ENABLE_ATARI_PADDLE)
@@ -702,43 +1590,177 @@ static void read_fullswitch( gamepad_status_t* gamepad) {
 // Fire pin connected to Ground pin = button/direction is pressed
 // Angle pin resistence to the Return pin is proportional to the paddle position (linear 1 Mohm, 270 degree)
 //
+// The Return pin is at ground and the Angle pin is pulled up, so the ADC reads
+// R / ( R + Rpullup) of the full scale: it is not linear in the position, and
+// each paddle uses a different part of the scale. So the range read from each
+// paddle is tracked, and it is saved in the persistent storage.
+//
+// At every change of the range, a table with the HID value at some points of
+// the range is rebuilt, so each read needs just a lookup and an interpolation.
+// Each entry takes two 32 bit divisions, so the table is rebuilt one entry per
+// step, and meanwhile the value is computed directly.
+//
 
-static void setup_atari_paddle(void){
+#if defined( ENABLE_ATARI_PADDLE)
+
+#define ATARI_PADDLE_MAGIC (0x5043)
+
+typedef struct {
+  uint16_t magic;
+  int16_t min[ 2];
+  int16_t max[ 2];
+} paddle_record_t;
+
+// R / Rpullup, in 10.10 fixed point; the pull-up value is not needed, since
+// only the shape matters between the ends of the range
+static uint32_t paddle_linearize( int16_t raw){
+  return ( (uint32_t) raw << 10) / ( 1024 - raw);
+}
+
+static int16_t paddle_span( const paddle_axis_t* axis){
+  int16_t span = axis->max - axis->min;
+  return span < ATARI_PADDLE_MIN_SPAN ? ATARI_PADDLE_MIN_SPAN : span;
+}
+
+// The table is left to paddle_build
+static void paddle_calibrate( paddle_axis_t* axis){
+
+  int16_t span = paddle_span( axis);
+  axis->base = axis->min;
+  if( axis->base > 1023 - span) axis->base = 1023 - span;
+  axis->scale = ( ( (uint32_t) ATARI_PADDLE_TABLE_SIZE << 16) + span -1) / span;
+
+  // Scaled down to 16 bit, so the products of paddle_exact fit 32 bit
+  axis->low = paddle_linearize( axis->base);
+  axis->full = paddle_linearize( axis->base + span) - axis->low;
+  axis->shift = 0;
+  while( ( axis->full >> axis->shift) > 0xffff) axis->shift += 1;
+  axis->full >>= axis->shift;
+  axis->built = 0;
+}
+
+static int16_t paddle_exact( const paddle_axis_t* axis, int16_t raw){
+  uint32_t part = ( paddle_linearize( raw) - axis->low) >> axis->shift;
+  return (int32_t)( part * 65535 / axis->full) - 32768;
+}
+
+// The next table entry; it returns 0 when the table is complete
+static int paddle_build( paddle_axis_t* axis){
+  if( axis->built > ATARI_PADDLE_TABLE_SIZE) return 0;
+  int16_t raw = axis->base + ( (int32_t) axis->built * paddle_span( axis) + ATARI_PADDLE_TABLE_SIZE / 2) / ATARI_PADDLE_TABLE_SIZE;
+  axis->table[ axis->built] = paddle_exact( axis, raw);
+  axis->built += 1;
+  return 1;
+}
+
+static int16_t paddle_position( const paddle_axis_t* axis, int16_t raw){
+  if( axis->built <= ATARI_PADDLE_TABLE_SIZE) return paddle_exact( axis, raw);
+  uint32_t position = (uint32_t)( raw - axis->base) * axis->scale;
+  uint16_t k = position >> 16;
+  if( k >= ATARI_PADDLE_TABLE_SIZE) return axis->table[ ATARI_PADDLE_TABLE_SIZE];
+  int16_t from = axis->table[ k];
+  return from + ( ( (int32_t)( axis->table[ k +1] - from) * ( ( position >> 8) & 0xff)) >> 8);
+}
+
+static void paddle_load( usb_pad_encoder_t* ctx){
+  paddle_record_t record;
+  storage_read( ATARI_PADDLE_STORAGE_ADDRESS, &record, sizeof( record));
+
+  // Holding both the fires forgets the saved range
+  int forget = !read_digital( ATARI_PADDLE_FIRST_FIRE_PIN) && !read_digital( ATARI_PADDLE_SECOND_FIRE_PIN);
+
+  for( int k = 0; k < 2; k += 1){
+    paddle_axis_t* axis = ctx->paddle.axis + k;
+    if( !forget && record.magic == ATARI_PADDLE_MAGIC
+    && record.min[ k] >= 0 && record.min[ k] <= record.max[ k] && record.max[ k] <= 1023){
+      axis->min = record.min[ k];
+      axis->max = record.max[ k];
+      paddle_calibrate( axis);
+      while( paddle_build( axis));
+    } else {
+      axis->min = 1;
+      axis->max = 0;
+    }
+  }
+  LOG( forget, "paddle calibration forgotten");
+}
+
+// A range change restarts the save
+static void paddle_save( usb_pad_encoder_t* ctx){
+  if( !ctx->paddle.save.pending) return;
+
+  paddle_record_t record;
+  memset( &record, 0, sizeof( record));
+  record.magic = ATARI_PADDLE_MAGIC;
+  for( int k = 0; k < 2; k += 1){
+    record.min[ k] = ctx->paddle.axis[ k].min;
+    record.max[ k] = ctx->paddle.axis[ k].max;
+  }
+  if( storage_save( ctx, &ctx->paddle.save, ATARI_PADDLE_STORAGE_ADDRESS, &record, sizeof( record)))
+    LOG(1, "paddle calibration saved: %d-%d %d-%d", record.min[ 0], record.max[ 0], record.min[ 1], record.max[ 1]);
+}
+
+// The range grows with every value outside it
+static int16_t paddle_axis( usb_pad_encoder_t* ctx, paddle_axis_t* axis, int16_t raw){
+  if( axis->min > axis->max || raw < axis->min || raw > axis->max){
+    if( axis->min > axis->max || raw < axis->min) axis->min = raw;
+    if( axis->min > axis->max || raw > axis->max) axis->max = raw;
+    paddle_calibrate( axis);
+    storage_schedule( ctx, &ctx->paddle.save, ATARI_PADDLE_SAVE_DELAY);
+  }
+  // The next steps must run also if the input does not change
+  if( paddle_build( axis)) wake_now( ctx);
+  return paddle_position( axis, raw);
+}
+
+// The moving average would start from 0, and it would stretch the range
+static void paddle_history( int16_t* buffer, int16_t size, int16_t value){
+  for( int k = 1; k < size; k += 1) buffer[ k] = value;
+}
+
+#endif // ENABLE_ATARI_PADDLE
+
+static void setup_atari_paddle( usb_pad_encoder_t* ctx){
+  (void) ctx;
 #if defined( ENABLE_ATARI_PADDLE)
 
   setup_input( ATARI_PADDLE_FIRST_FIRE_PIN, 1);
   setup_input( ATARI_PADDLE_FIRST_ANGLE_PIN, 1);
   setup_input( ATARI_PADDLE_SECOND_FIRE_PIN, 1);
   setup_input( ATARI_PADDLE_SECOND_ANGLE_PIN, 1);
+
+  paddle_history( ctx->first_axis_history,  10, read_analog( ATARI_PADDLE_FIRST_ANGLE_PIN));
+  paddle_history( ctx->second_axis_history, 10, read_analog( ATARI_PADDLE_SECOND_ANGLE_PIN));
+  paddle_load( ctx);
 #endif // ENABLE_ATARI_PADDLE
 }
 
 
-static void read_atari_paddle( gamepad_status_t* gamepad) {
+static void read_atari_paddle( usb_pad_encoder_t* ctx, gamepad_status_t* gamepad) {
+  (void) ctx; (void) gamepad;
 #if defined( ENABLE_ATARI_PADDLE)
-  static timed_t debounce_slot[ 2] = { 0};
-
-#define RDD( I, P) button_debounce( debounce_slot + (I), !read_digital( P ))
-  gamepad->fire1 |= RDD( 0, ATARI_PADDLE_FIRST_FIRE_PIN);
-  gamepad->fire2 |= RDD( 1, ATARI_PADDLE_SECOND_FIRE_PIN);
+#define RDD( I, P) button_debounce( ctx, ctx->debounce_slot + (I), !read_digital( P ))
+  gamepad->fire1 |= RDD( 16, ATARI_PADDLE_FIRST_FIRE_PIN);
+  gamepad->fire2 |= RDD( 17, ATARI_PADDLE_SECOND_FIRE_PIN);
 #undef RDD
   gamepad->axis[0] = read_analog( ATARI_PADDLE_FIRST_ANGLE_PIN);
   gamepad->axis[1] = read_analog( ATARI_PADDLE_SECOND_ANGLE_PIN);
 #endif // ENABLE_ATARI_PADDLE
 }
 
-static void process_atari_axis( gamepad_status_t* gamepad) {
+static void process_atari_axis( usb_pad_encoder_t* ctx, gamepad_status_t* gamepad) {
+  (void) ctx; (void) gamepad;
 #if defined( ENABLE_ATARI_PADDLE)
-  static int16_t first_axis_history[10] = {0};
-  static int16_t second_axis_history[10] = {0};
-
   // Moving average to reduce noise on the analog readinng
-  gamepad->axis[0] = moving_average(first_axis_history,  10, gamepad->axis[0]);
-  gamepad->axis[1] = moving_average(second_axis_history, 10, gamepad->axis[1]);
+  gamepad->axis[0] = moving_average( ctx, ctx->first_axis_history,  10, gamepad->axis[0]);
+  gamepad->axis[1] = moving_average( ctx, ctx->second_axis_history, 10, gamepad->axis[1]);
 
   // Axis calibration
-  gamepad->axis[0] = (gamepad->axis[0] - 500) << 6;
-  gamepad->axis[1] = (gamepad->axis[1] - 500) << 5;
+  gamepad->axis[0] = paddle_axis( ctx, ctx->paddle.axis + 0, gamepad->axis[0]);
+  gamepad->axis[1] = paddle_axis( ctx, ctx->paddle.axis + 1, gamepad->axis[1]);
+
+  // The range is saved only when it is stable, to save the EEPROM wear
+  paddle_save( ctx);
 
   //// Debugging
   //gamepad->axis[0] = gamepad->axis[0] > 256 ? 32000 : -32000;
@@ -747,6 +1769,76 @@ static void process_atari_axis( gamepad_status_t* gamepad) {
 #endif // ENABLE_ATARI_PADDLE
 }
 
+// Spinner / Driving controller protocol -----------------------------------------
+
+//
+// Arcade spinners and the Atari 2600 driving controller use the same DB9 pinout
+// of the Atari joystick, but the Up/Down pins carry a 2-bit gray code (quadrature)
+// instead of two switches.
+//
+// A (Up)    __|""""|____|""""|____
+// B (Down)  ____|""""|____|""""|__
+//
+// When A leads B (as above) each edge counts +1, when B leads A it counts -1.
+//
+// The edges can come at several kHz, that is much faster than the step rate, so
+// they are decoded in the pin-change interrupt and only the accumulated count is
+// consumed by the step.
+//
+
+#if defined( ENABLE_SPINNER)
+
+// Indexed by ( previous_AB << 2) | current_AB. Invalid transitions (both pins
+// changed, e.g. for a missed edge) are ignored.
+static const int8_t quadrature_table[ 16] = {
+   0, -1, +1,  0,
+  +1,  0,  0, -1,
+  -1,  0,  0, +1,
+   0, +1, -1,  0,
+};
+
+// Attached to the hardware, so shared by all the contexts
+static volatile uint8_t spinner_state = 0;
+static volatile int16_t spinner_count = 0;
+
+static void spinner_isr(void){
+  uint8_t state = (( spinner_state << 2) & 0x0C)
+                | ( !!read_digital( SPINNER_A_PIN) << 1)
+                | ( !!read_digital( SPINNER_B_PIN));
+  spinner_count += quadrature_table[ state];
+  spinner_state = state;
+}
+#endif // ENABLE_SPINNER
+
+static void setup_spinner( usb_pad_encoder_t* ctx){
+  (void) ctx;
+#if defined( ENABLE_SPINNER)
+
+  setup_input( SPINNER_A_PIN, 1);
+  setup_input( SPINNER_B_PIN, 1);
+  spinner_state = ( !!read_digital( SPINNER_A_PIN) << 1) | !!read_digital( SPINNER_B_PIN);
+  spinner_count = 0;
+  attach_pin_change( SPINNER_A_PIN, spinner_isr);
+  attach_pin_change( SPINNER_B_PIN, spinner_isr);
+#endif // ENABLE_SPINNER
+}
+
+static void read_spinner( usb_pad_encoder_t* ctx, gamepad_status_t* gamepad) {
+  (void) ctx; (void) gamepad;
+#if defined( ENABLE_SPINNER)
+
+  // Take at most what fits in the report; the rest is kept for the next one
+  disable_interrupts();
+  int16_t count = spinner_count;
+  if( count >  127) count =  127;
+  if( count < -127) count = -127;
+  spinner_count -= count;
+  enable_interrupts();
+
+  gamepad->spinner = count;
+#endif // ENABLE_SPINNER
+}
+
 // SNES pad protocol --------------------------------------------------------------
 
 //
@@ -772,7 +1864,8 @@ static void process_atari_axis( gamepad_status_t* gamepad) {
 //     12 us
 //
 
-static void setup_snes(void){
+static void setup_snes( usb_pad_encoder_t* ctx){
+  (void) ctx;
 #if defined( ENABLE_SNES)
 
   setup_output( SNES_CLOCK_PIN);
@@ -799,7 +1892,8 @@ static int read_next_button_snes(int pin, int semiwait) {
 }
 #endif // ENALBE_SNES
 
-static void read_snes( gamepad_status_t* gamepad) {
+static void read_snes( usb_pad_encoder_t* ctx, gamepad_status_t* gamepad) {
+  (void) ctx; (void) gamepad;
 #if defined( ENABLE_SNES)
 
   write_digital(SNES_LATCH_PIN, 1);
@@ -822,37 +1916,1049 @@ static void read_snes( gamepad_status_t* gamepad) {
 #endif // ENABLE_SNES
 }
 
+// N64 and GameCube pad protocol --------------------------------------------------
+
+//
+// Both the pads use a single open-drain DATA line, plus the Ground and the
+// 3.3V supply (the GameCube pad wants also 5V for the rumble motor). A 1 Kohm
+// pull-up resistor must connect DATA to 3.3V: the line is only pulled low, never
+// driven high, and 5V would damage the pad.
+//
+// Each bit lasts 4 us, and it starts pulling the line low:
+//
+//         1us    3us                    3us      1us
+//       ""|__|"""""""""|""        ""|________|"""|""
+//           bit = 1                     bit = 0
+//
+// The console sends a request, MSB first, followed by a stop bit (a 1); after a
+// few us the pad answers in the same way, with a 2us-low stop bit.
+//
+// Request                           Answer
+// 0x00              identify        3 bytes: 0x05 0x00 ... for the N64 pad,
+//                                            0x09 0x00 ... for the GameCube one
+// 0x01              N64 poll        4 bytes
+// 0x40 0x03 0x00    GameCube poll   8 bytes (mode 3, rumble off)
+//
+// N64 answer
+//   A  B  Z  St ^  v  <  > | Rs 0  L  R  C^ Cv C< C> | X | Y
+//
+// GameCube answer
+//   0  0  0  St Y  X  B  A | 1  L  R  Z  ^  v  >  < | X | Y | C-X | C-Y | L | R
+//
+// Rs = Reset (L + R + Start), 0/1 = always 0/1
+// X, Y = stick, signed 8 bit for the N64, centered at 128 for the GameCube
+// C-X, C-Y = C stick; L, R = analog trigger, 0 when released
+//
+// Mapping: A -> Fire 1, B -> Fire 2, X -> Fire 3, Y -> Fire 4, L -> Fire 5,
+// R -> Fire 6, Z -> Fire 7; the stick on the X/Y axis, the C stick (or the C
+// buttons of the N64 pad) on the Rx/Ry axis, the analog L/R on the Z/Rz axis.
+//
+// The timing is too tight for read_digital and write_digital, so the whole
+// transfer is done by the platform in the following function:
+//
+//   uint8_t joybus_transfer( uint8_t pin, const uint8_t* request,
+//                            uint8_t request_len, uint8_t* low_time,
+//                            uint8_t max_bits)
+//
+// It sends the request bytes and the stop bit, then it records how long the
+// line stays low in each bit of the answer, in 1/JOYBUS_COUNTS_PER_US us units
+// (2 by default). It stops after max_bits bits, or when the line does not fall
+// within 32 us for the first bit and 8 us for the others, and it returns the
+// number of recorded bits. It must not take more than 400 us.
+//
+// A step makes at most one transfer, one every JOYBUS_POLL_PERIOD us: about
+// 70 us to look for a pad, 180 us to poll the N64 one, 370 us for the
+// GameCube one. The other steps just copy the last answer.
+//
+
+#ifndef JOYBUS_COUNTS_PER_US
+#define JOYBUS_COUNTS_PER_US 2
+#endif
+
+#define JOYBUS_POLL_PERIOD   (2000)   // us
+#define JOYBUS_DETECT_PERIOD (100000) // us // used when no pad is connected
+#define JOYBUS_MAX_FAILURES  (3)      // # // failed polls before removing the pad
+
+#define JOYBUS_NONE     0
+#define JOYBUS_N64      1
+#define JOYBUS_GAMECUBE 2
+
+#if defined( ENABLE_JOYBUS)
+// The last bit is the stop one, so a complete answer has len*8 +1 bits. A bit
+// is 1 if the line was low for less than 2 us.
+static int joybus_decode( const uint8_t* low_time, int bits, uint8_t* data, int len){
+  if( bits < len * 8 +1) return 0;
+  for( int k = 0; k < len; k += 1){
+    uint8_t byte = 0;
+    for( int b = 0; b < 8; b += 1){
+      byte = ( byte << 1) | ( *low_time < 2 * JOYBUS_COUNTS_PER_US);
+      low_time += 1;
+    }
+    data[ k] = byte;
+  }
+  return 1;
+}
+
+static int joybus_request( const uint8_t* request, int request_len, uint8_t* answer, int answer_len){
+  uint8_t low_time[ 8 * 8 +1];
+  int bits = joybus_transfer( JOYBUS_DATA_PIN, request, request_len, low_time, answer_len * 8 +1);
+  return joybus_decode( low_time, bits, answer, answer_len);
+}
+
+static int16_t joybus_axis( long value){
+  if( value >  32767) return  32767;
+  if( value < -32768) return -32768;
+  return value;
+}
+#endif // ENABLE_JOYBUS
+
+static void setup_joybus( usb_pad_encoder_t* ctx){
+  (void) ctx;
+#if defined( ENABLE_JOYBUS)
+
+  // The line is released (high impedance), the transfer will pull it low
+  setup_input( JOYBUS_DATA_PIN, 0);
+  ctx->joybus.type = JOYBUS_NONE;
+#endif // ENABLE_JOYBUS
+}
+
+static void read_joybus( usb_pad_encoder_t* ctx, gamepad_status_t* gamepad) {
+  (void) ctx; (void) gamepad;
+#if defined( ENABLE_JOYBUS)
+  static const uint8_t identify[] = { 0x00};
+  static const uint8_t poll_n64[] = { 0x01};
+  static const uint8_t poll_gamecube[] = { 0x40, 0x03, 0x00};
+  const unsigned long now = current_time_step( ctx);
+  uint8_t answer[ 8];
+
+  if( (long)( now - ctx->joybus.next_poll) >= 0){
+    if( ctx->joybus.type == JOYBUS_NONE){
+      ctx->joybus.next_poll = now + JOYBUS_DETECT_PERIOD;
+      if( joybus_request( identify, sizeof( identify), answer, 3)){
+        ctx->joybus.type = ( answer[ 0] & 0x08) ? JOYBUS_GAMECUBE : JOYBUS_N64;
+        ctx->joybus.failures = 0;
+        ctx->joybus.next_poll = now + JOYBUS_POLL_PERIOD;
+        LOG(1, "joybus pad connected: %x %x %x", answer[ 0], answer[ 1], answer[ 2]);
+      }
+    } else {
+      int valid;
+      ctx->joybus.next_poll = now + JOYBUS_POLL_PERIOD;
+      if( ctx->joybus.type == JOYBUS_N64)
+        valid = joybus_request( poll_n64, sizeof( poll_n64), answer, 4)
+             && !( answer[ 1] & 0x40);
+      else
+        valid = joybus_request( poll_gamecube, sizeof( poll_gamecube), answer, 8)
+             && !( answer[ 0] & 0xe0) && ( answer[ 1] & 0x80);
+      if( valid){
+        memcpy( ctx->joybus.answer, answer, sizeof( answer));
+        ctx->joybus.failures = 0;
+      } else {
+        // A single bad answer (e.g. a noisy line) keeps the last state
+        ctx->joybus.failures += 1;
+        if( ctx->joybus.failures >= JOYBUS_MAX_FAILURES){
+          ctx->joybus.type = JOYBUS_NONE;
+          memset( ctx->joybus.answer, 0, sizeof( ctx->joybus.answer));
+          LOG(1, "joybus pad removed");
+        }
+      }
+    }
+  }
+
+  const uint8_t* a = ctx->joybus.answer;
+  int16_t* axis = gamepad->axis + JOYBUS_AXIS;
+  switch( ctx->joybus.type){
+    case JOYBUS_N64:
+      gamepad->fire1 |= a[ 0] >> 7;     // A
+      gamepad->fire2 |= a[ 0] >> 6 & 1; // B
+      gamepad->fire7 |= a[ 0] >> 5 & 1; // Z
+      gamepad->start |= a[ 0] >> 4 & 1;
+      gamepad->up    |= a[ 0] >> 3 & 1;
+      gamepad->down  |= a[ 0] >> 2 & 1;
+      gamepad->left  |= a[ 0] >> 1 & 1;
+      gamepad->right |= a[ 0]      & 1;
+      gamepad->fire5 |= a[ 1] >> 5 & 1; // L
+      gamepad->fire6 |= a[ 1] >> 4 & 1; // R
+      // The stick range is about +/-85
+      axis[ 0] = joybus_axis(  (long)(int8_t) a[ 2] * 384);
+      axis[ 1] = joybus_axis( -(long)(int8_t) a[ 3] * 384);
+      // C buttons: right - left, down - up
+      axis[ 2] = (( a[ 1] & 1) - ( a[ 1] >> 1 & 1)) * 32767;
+      axis[ 3] = (( a[ 1] >> 2 & 1) - ( a[ 1] >> 3 & 1)) * 32767;
+      axis[ 4] = ( a[ 1] >> 5 & 1) ? 32767 : -32768;
+      axis[ 5] = ( a[ 1] >> 4 & 1) ? 32767 : -32768;
+      break;
+    case JOYBUS_GAMECUBE:
+      gamepad->fire1 |= a[ 0]      & 1; // A
+      gamepad->fire2 |= a[ 0] >> 1 & 1; // B
+      gamepad->fire3 |= a[ 0] >> 2 & 1; // X
+      gamepad->fire4 |= a[ 0] >> 3 & 1; // Y
+      gamepad->start |= a[ 0] >> 4 & 1;
+      gamepad->fire5 |= a[ 1] >> 6 & 1; // L
+      gamepad->fire6 |= a[ 1] >> 5 & 1; // R
+      gamepad->fire7 |= a[ 1] >> 4 & 1; // Z
+      gamepad->up    |= a[ 1] >> 3 & 1;
+      gamepad->down  |= a[ 1] >> 2 & 1;
+      gamepad->right |= a[ 1] >> 1 & 1;
+      gamepad->left  |= a[ 1]      & 1;
+      axis[ 0] = joybus_axis(  ( (long) a[ 2] - 128) * 256);
+      axis[ 1] = joybus_axis( -( (long) a[ 3] - 128) * 256);
+      axis[ 2] = joybus_axis(  ( (long) a[ 4] - 128) * 256);
+      axis[ 3] = joybus_axis( -( (long) a[ 5] - 128) * 256);
+      axis[ 4] = (long) a[ 6] * 257 - 32768;
+      axis[ 5] = (long) a[ 7] * 257 - 32768;
+      break;
+  }
+#endif // ENABLE_JOYBUS
+}
+
+// PlayStation pad protocol -------------------------------------------------------
+
+//
+// Front view of the pad plug
+//
+//    _____________________________
+//   | O  O  O | O  O  O | O  O  O |
+//    \___________________________/
+//     D  C  m   G  V  A   K  un Ack
+//
+// D = DATA set by the pad (open collector, a 1 Kohm pull-up to V is needed)
+// C = COMMAND set by the console
+// m = 7.6V for the rumble motors (can be left unconnected)
+// G = Ground
+// V = Vcc (3.3V)
+// A = ATTENTION set by the console (low during a transfer)
+// K = CLOCK set by the console
+// Ack = ACK set by the pad, a short low pulse after each byte but the last one
+//
+// It is a SPI bus, mode 3, LSB first. The console sends a command while ATT is
+// low and, at the same time, the pad answers:
+//
+// ATT    """|_________________________________________________________|"""""
+// CLOCK  """""|"|_|"|_|"|_..._|""""""""""|"|_|"|_..._|"""..."""|"|_...|"""""
+// COMMAND     0x01             ...        0x42                  ...
+// DATA        (0xff)           ...        ID                    ...
+// ACK    """"""""""""""""""""""|_|"""""""""""""""""""""|_|""""""""""""""""
+//
+// Command   0x01 0x42 0x00 0x00 0x00 ...  poll
+// Answer    0xff ID   0x5a B1   B2   ...  ID = 0x41 digital, 0x73 analog,
+//                                              0x79 analog with pressure,
+//                                              0xf3 configuration mode
+// The low nibble of ID is the number of 16 bit words after 0x5a.
+//
+// B1 (bit 0 first)    Sel L3 R3 St ^  >  v  <
+// B2                  L2  R2 L1 R1 /\ O  X  []
+// Analog              RX  RY LX LY (centered at 128)
+// Pressure            >  <  ^  v  /\ O  X  [] L1 R1 L2 R2
+//
+// The buttons are 0 when pressed. At startup the pad is put in analog mode,
+// with the pressure enabled if it is a DualShock 2, through the configuration
+// commands (0x43 enter/exit, 0x44 analog mode, 0x4f pressure).
+//
+// Mapping: Circle -> Fire 1, Cross -> Fire 2, Triangle -> Fire 3, Square ->
+// Fire 4, L1 -> Fire 5, R1 -> Fire 6, L2 -> Fire 7, R2 -> Fire 8, L3 -> Fire 9,
+// R3 -> Fire 10; the left stick on the X/Y axis, the right one on the Rx/Ry
+// axis, the pressure of L2, R2, Cross and Square on the Z, Rz, Slider and
+// Wheel axis.
+//
+// The bytes are exchanged through the hardware SPI with the following platform
+// functions; they must not wait for the transfer:
+//
+//   void spi_setup( unsigned long hz)   // master, mode 3, LSB first, at most hz
+//   void spi_start( uint8_t data)       // start the exchange of a byte
+//   int spi_result( void)               // the received byte, -1 if not done
+//
+// Each step moves the transfer as far as it can without waiting, so a poll is
+// spread among some steps. The next byte is sent after the ACK pulse, or after
+// PSX_ACK_TIMEOUT if the pad does not generate it. The fastest clock that
+// gives valid answers is selected when the pad is connected.
+//
+
+#define PSX_POLL_PERIOD   (1000)   // us
+#define PSX_DETECT_PERIOD (100000) // us // used when no pad is connected
+#define PSX_ACK_TIMEOUT   (100)    // us
+#define PSX_MAX_FAILURES  (3)      // # // failed polls before removing the pad
+
+#if defined( ENABLE_PSX)
+static const unsigned long psx_clock[] = { 1000000, 500000, 250000};
+#define PSX_CLOCK_COUNT ( sizeof( psx_clock) / sizeof( *psx_clock))
+
+static const uint8_t psx_poll[ PSX_MAX_ANSWER] = { 0x01, 0x42};
+static const uint8_t psx_config_enter[ PSX_MAX_ANSWER] = { 0x01, 0x43, 0x00, 0x01};
+static const uint8_t psx_config_analog[ PSX_MAX_ANSWER] = { 0x01, 0x44, 0x00, 0x01, 0x03};
+static const uint8_t psx_config_pressure[ PSX_MAX_ANSWER] = { 0x01, 0x4f, 0x00, 0xff, 0xff, 0x03};
+static const uint8_t psx_config_exit[ PSX_MAX_ANSWER] = { 0x01, 0x43, 0x00, 0x00, 0x5a, 0x5a, 0x5a, 0x5a, 0x5a};
+
+// Commands sent after a pad is found; the last one is repeated
+static const uint8_t* const psx_sequence[] = {
+  psx_poll,
+  psx_config_enter, psx_config_analog, psx_config_pressure, psx_config_exit,
+  psx_poll,
+};
+#define PSX_SEQUENCE_LAST ( sizeof( psx_sequence) / sizeof( *psx_sequence) -1)
+
+#define PSX_IDLE 0
+#define PSX_BYTE 1 // waiting the SPI
+#define PSX_ACK  2 // waiting the ACK
+
+// Attached to the hardware, so shared by all the contexts
+static volatile uint8_t psx_ack_edges = 0;
+
+static void psx_ack_isr(void){
+  psx_ack_edges += 1;
+}
+
+static void psx_byte_start( usb_pad_encoder_t* ctx, const uint8_t* command){
+  psx_ack_edges = 0;
+  ctx->psx.byte_time = current_time_step( ctx);
+  spi_start( command[ ctx->psx.position]);
+  ctx->psx.state = PSX_BYTE;
+}
+
+static int psx_answer_valid( usb_pad_encoder_t* ctx){
+  const uint8_t id = ctx->psx.answer[ 1];
+  return ctx->psx.answer[ 2] == 0x5a && ( id == 0x41 || id == 0x73 || id == 0x79);
+}
+
+static void psx_transfer_done( usb_pad_encoder_t* ctx){
+  if( ctx->psx.sequence == 0){
+    // Looking for a pad, from the fastest clock to the slowest
+    if( psx_answer_valid( ctx)){
+      ctx->psx.sequence = 1;
+      LOG(1, "psx pad connected: id %x, clock %lu", ctx->psx.answer[ 1], psx_clock[ ctx->psx.clock]);
+    } else if( ctx->psx.clock + 1 < PSX_CLOCK_COUNT){
+      ctx->psx.clock += 1;
+      spi_setup( psx_clock[ ctx->psx.clock]);
+    } else {
+      ctx->psx.clock = 0;
+      spi_setup( psx_clock[ ctx->psx.clock]);
+      ctx->psx.next_transfer = current_time_step( ctx) + PSX_DETECT_PERIOD;
+    }
+  } else if( ctx->psx.sequence < PSX_SEQUENCE_LAST){
+    // Configuration
+    if( ctx->psx.answer[ 2] == 0x5a) ctx->psx.sequence += 1;
+    else ctx->psx.sequence = 0;
+  } else if( psx_answer_valid( ctx)){
+    memcpy( ctx->psx.last, ctx->psx.answer, sizeof( ctx->psx.answer));
+    ctx->psx.failures = 0;
+  } else {
+    // A single bad answer (e.g. a noisy line) keeps the last state, more of
+    // them start a new search, from the current clock
+    ctx->psx.failures += 1;
+    if( ctx->psx.failures >= PSX_MAX_FAILURES){
+      ctx->psx.failures = 0;
+      ctx->psx.sequence = 0;
+      memset( ctx->psx.last, 0, sizeof( ctx->psx.last));
+      LOG(1, "psx pad removed");
+    }
+  }
+}
+
+static void psx_transfer( usb_pad_encoder_t* ctx){
+  const unsigned long now = current_time_step( ctx);
+  const uint8_t* command = psx_sequence[ ctx->psx.sequence];
+
+  if( ctx->psx.state == PSX_IDLE){
+    if( (long)( now - ctx->psx.next_transfer) < 0) return;
+    ctx->psx.next_transfer = now + PSX_POLL_PERIOD;
+    write_digital( PSX_ATTENTION_PIN, 0);
+    ctx->psx.position = 0;
+    ctx->psx.length = 3;
+    psx_byte_start( ctx, command);
+  }
+
+  for(;;){
+    if( ctx->psx.state == PSX_BYTE){
+      int data = spi_result();
+      if( data < 0) return;
+      ctx->psx.answer[ ctx->psx.position] = data;
+      ctx->psx.position += 1;
+      // The ID tells the length of the whole transfer; 0xff is an unconnected
+      // DATA line
+      if( ctx->psx.position == 2){
+        ctx->psx.length = data == 0xff ? 2 : 3 + 2 * ( data & 0x0f);
+        if( ctx->psx.length > PSX_MAX_ANSWER) ctx->psx.length = PSX_MAX_ANSWER;
+      }
+      if( ctx->psx.position >= ctx->psx.length){
+        write_digital( PSX_ATTENTION_PIN, 1);
+        memset( ctx->psx.answer + ctx->psx.length, 0, PSX_MAX_ANSWER - ctx->psx.length);
+        ctx->psx.state = PSX_IDLE;
+        psx_transfer_done( ctx);
+        return;
+      }
+      ctx->psx.state = PSX_ACK;
+    }
+    if( ctx->psx.state == PSX_ACK){
+      // Both the edges of the pulse, so a late rising one is not taken as the
+      // ACK of the next byte
+      if( psx_ack_edges < 2 && now - ctx->psx.byte_time < PSX_ACK_TIMEOUT) return;
+      psx_byte_start( ctx, command);
+    }
+  }
+}
+
+static int16_t psx_pressure( usb_pad_encoder_t* ctx, uint8_t pressure, int pressed){
+  if( ctx->psx.last[ 1] != 0x79) return pressed ? 32767 : -32768;
+  return (long) pressure * 257 - 32768;
+}
+#endif // ENABLE_PSX
+
+static void setup_psx( usb_pad_encoder_t* ctx){
+  (void) ctx;
+#if defined( ENABLE_PSX)
+
+  setup_output( PSX_ATTENTION_PIN);
+  write_digital( PSX_ATTENTION_PIN, 1);
+  setup_input( PSX_DATA_PIN, 1);
+  setup_input( PSX_ACK_PIN, 1);
+  attach_pin_change( PSX_ACK_PIN, psx_ack_isr);
+  ctx->psx.clock = 0;
+  spi_setup( psx_clock[ ctx->psx.clock]);
+#endif // ENABLE_PSX
+}
+
+static void read_psx( usb_pad_encoder_t* ctx, gamepad_status_t* gamepad) {
+  (void) ctx; (void) gamepad;
+#if defined( ENABLE_PSX)
+
+  psx_transfer( ctx);
+
+  const uint8_t* a = ctx->psx.last;
+  if( !a[ 1]) return;
+  const uint8_t b1 = ~a[ 3];
+  const uint8_t b2 = ~a[ 4];
+  gamepad->select |= b1      & 1;
+  gamepad->fire9  |= b1 >> 1 & 1; // L3
+  gamepad->fire10 |= b1 >> 2 & 1; // R3
+  gamepad->start  |= b1 >> 3 & 1;
+  gamepad->up     |= b1 >> 4 & 1;
+  gamepad->right  |= b1 >> 5 & 1;
+  gamepad->down   |= b1 >> 6 & 1;
+  gamepad->left   |= b1 >> 7 & 1;
+  gamepad->fire7  |= b2      & 1; // L2
+  gamepad->fire8  |= b2 >> 1 & 1; // R2
+  gamepad->fire5  |= b2 >> 2 & 1; // L1
+  gamepad->fire6  |= b2 >> 3 & 1; // R1
+  gamepad->fire3  |= b2 >> 4 & 1; // Triangle
+  gamepad->fire1  |= b2 >> 5 & 1; // Circle
+  gamepad->fire2  |= b2 >> 6 & 1; // Cross
+  gamepad->fire4  |= b2 >> 7 & 1; // Square
+
+  int16_t* axis = gamepad->axis + PSX_AXIS;
+  if( a[ 1] != 0x41){
+    axis[ 0] = ( (int) a[ 7] - 128) * 256; // LX
+    axis[ 1] = ( (int) a[ 8] - 128) * 256; // LY
+    axis[ 2] = ( (int) a[ 5] - 128) * 256; // RX
+    axis[ 3] = ( (int) a[ 6] - 128) * 256; // RY
+  }
+  axis[ 4] = psx_pressure( ctx, a[ 19], b2      & 1); // L2
+  axis[ 5] = psx_pressure( ctx, a[ 20], b2 >> 1 & 1); // R2
+  axis[ 6] = psx_pressure( ctx, a[ 15], b2 >> 6 & 1); // Cross
+  axis[ 7] = psx_pressure( ctx, a[ 16], b2 >> 7 & 1); // Square
+#endif // ENABLE_PSX
+}
+
+// Sega Mega Drive / Genesis pad protocol -----------------------------------------
+
+//
+// Front view of famle DB9
+// ( the one at end of the pad cable)
+//
+//        V   R   L   D   U
+//    \""""""""""""""""""""""/
+//     \  O   O   O   O   O / <- DB9-pin-1
+//      \   O   O   O   O  /
+//       \________________/
+//         TR   G   S  TL
+//
+// V = +5V (needed)
+// G = Ground
+// S = SELECT set by the console
+// U, D, L, R, TL, TR = set by the pad, 0 when the button is pressed
+//
+// The pins are the Master System ones (so the same adapter can be used) plus
+// SELECT and +5V. The pad shows different buttons according to SELECT:
+//
+// SELECT          U   D   L   R   TL  TR
+// high            ^   v   <   >   B   C
+// low             ^   v   0   0   A   St
+// 3rd low         0   0   0   0   A   St  (6 button pad only)
+// 4th high        Z   Y   X   Md  B   C   (6 button pad only)
+//
+// Md = Mode
+//
+// The 6 button pad counts the SELECT pulses, and it resets the count after
+// about 1.5 ms without pulses, so the whole sequence is made at most every
+// GENESIS_READ_PERIOD, and the last state is reported in the other steps:
+//
+// SELECT """"|____|""""|____|""""|____|""""|____|"""""""
+// read     0    1                   2    3
+//
+// Each read waits GENESIS_SETTLE after the change of SELECT; the sequence
+// takes some tens of us. A pad is a 6 button one if it shows all 0 at read 2;
+// the Left and Right at 0 in read 1 tell that it is not a Master System pad,
+// that is read as by the fullswitch protocol.
+//
+// Mapping: A -> Fire 1, B -> Fire 2, C -> Fire 3, X -> Fire 4, Y -> Fire 5,
+// Z -> Fire 6, Mode -> Select.
+//
+
+#define GENESIS_READ_PERIOD (2000) // us
+#define GENESIS_SETTLE      (2)    // us
+
+#if defined( ENABLE_GENESIS)
+static void genesis_select( int level){
+  write_digital( GENESIS_SELECT_PIN, level);
+  delay_microsecond( GENESIS_SETTLE);
+}
+#endif // ENABLE_GENESIS
+
+static void setup_genesis( usb_pad_encoder_t* ctx){
+  (void) ctx;
+#if defined( ENABLE_GENESIS)
+
+  setup_input( GENESIS_UP_PIN, 1);
+  setup_input( GENESIS_DOWN_PIN, 1);
+  setup_input( GENESIS_LEFT_PIN, 1);
+  setup_input( GENESIS_RIGHT_PIN, 1);
+  setup_input( GENESIS_TL_PIN, 1);
+  setup_input( GENESIS_TR_PIN, 1);
+  setup_output( GENESIS_SELECT_PIN);
+  write_digital( GENESIS_SELECT_PIN, 1);
+#endif // ENABLE_GENESIS
+}
+
+static void read_genesis( usb_pad_encoder_t* ctx, gamepad_status_t* gamepad) {
+  (void) ctx; (void) gamepad;
+#if defined( ENABLE_GENESIS)
+  const unsigned long now = current_time_step( ctx);
+
+  if( (long)( now - ctx->genesis.next_read) >= 0){
+    gamepad_status_t pad = {0};
+    ctx->genesis.next_read = now + GENESIS_READ_PERIOD;
+
+    // Read 0, SELECT is high since the previous sequence
+    pad.up    = !read_digital( GENESIS_UP_PIN);
+    pad.down  = !read_digital( GENESIS_DOWN_PIN);
+    pad.left  = !read_digital( GENESIS_LEFT_PIN);
+    pad.right = !read_digital( GENESIS_RIGHT_PIN);
+    const int tl = !read_digital( GENESIS_TL_PIN);
+    const int tr = !read_digital( GENESIS_TR_PIN);
+
+    // Read 1
+    genesis_select( 0);
+    const int connected = !read_digital( GENESIS_LEFT_PIN) && !read_digital( GENESIS_RIGHT_PIN);
+    pad.fire1 = !read_digital( GENESIS_TL_PIN); // A
+    pad.start = !read_digital( GENESIS_TR_PIN);
+    genesis_select( 1);
+    genesis_select( 0);
+    genesis_select( 1);
+
+    // Read 2
+    genesis_select( 0);
+    const int six_button = !( read_digital( GENESIS_UP_PIN) || read_digital( GENESIS_DOWN_PIN)
+                           || read_digital( GENESIS_LEFT_PIN) || read_digital( GENESIS_RIGHT_PIN));
+
+    // Read 3
+    genesis_select( 1);
+    if( connected && six_button){
+      pad.fire6  = !read_digital( GENESIS_UP_PIN);    // Z
+      pad.fire5  = !read_digital( GENESIS_DOWN_PIN);  // Y
+      pad.fire4  = !read_digital( GENESIS_LEFT_PIN);  // X
+      pad.select = !read_digital( GENESIS_RIGHT_PIN); // Mode
+    }
+    genesis_select( 0);
+    genesis_select( 1);
+
+    if( connected){
+      pad.fire2 = tl; // B
+      pad.fire3 = tr; // C
+    } else {
+      // Master System pad (it does not change with SELECT), or no pad
+      pad.fire1 = tl;
+      pad.fire2 = tr;
+      pad.start = 0;
+    }
+    if( connected && six_button != ctx->genesis.six_button)
+      LOG(1, "genesis pad with %d buttons", six_button ? 6 : 3);
+    ctx->genesis.six_button = connected && six_button;
+    ctx->genesis.last = pad;
+  }
+
+  const gamepad_status_t* pad = &ctx->genesis.last;
+  gamepad->up     |= pad->up;
+  gamepad->down   |= pad->down;
+  gamepad->left   |= pad->left;
+  gamepad->right  |= pad->right;
+  gamepad->start  |= pad->start;
+  gamepad->select |= pad->select;
+  gamepad->fire1  |= pad->fire1;
+  gamepad->fire2  |= pad->fire2;
+  gamepad->fire3  |= pad->fire3;
+  gamepad->fire4  |= pad->fire4;
+  gamepad->fire5  |= pad->fire5;
+  gamepad->fire6  |= pad->fire6;
+#endif // ENABLE_GENESIS
+}
+
+// Runtime settings ---------------------------------------------------------------
+
+//
+// With RUNTIME_SETTINGS, the autofire options, the protocols and the
+// full-switch pins are read from the persistent storage at init, and the host
+// can change them with a feature report. They are compiled in a plan for the
+// step: the list of the enabled stages, and of the enabled switches with their
+// button masks, so the step does not check the settings at all.
+//
+
+#if defined( RUNTIME_SETTINGS)
+
+// Full-switch indexes whose pins are used by each protocol
+#define SHARED_SPINNER      (0x0003) // up, down
+#define SHARED_PSX          (0x1045) // up, left, fire 1, fire 7
+#define SHARED_GENESIS      (0x01cf) // up, down, left, right, fire 1-3
+#define SHARED_SNES         (0x3800) // fire 6-8
+#define SHARED_JOYBUS       (0x0800) // fire 6
+#define SHARED_ATARI_PADDLE (0xc000) // fire 9, fire 10
+
+// Button of a full-switch index, in the gamepad_buttons bits
+static uint16_t switch_button( int index){
+  gamepad_status_t status;
+  memset( &status, 0, sizeof( status));
+  switch( index){
+    case 0:  status.up     = 1; break;
+    case 1:  status.down   = 1; break;
+    case 2:  status.left   = 1; break;
+    case 3:  status.right  = 1; break;
+    case 4:  status.select = 1; break;
+    case 5:  status.start  = 1; break;
+    case 6:  status.fire1  = 1; break;
+    case 7:  status.fire2  = 1; break;
+    case 8:  status.fire3  = 1; break;
+    case 9:  status.fire4  = 1; break;
+    case 10: status.fire5  = 1; break;
+    case 11: status.fire6  = 1; break;
+    case 12: status.fire7  = 1; break;
+    case 13: status.fire8  = 1; break;
+    case 14: status.fire9  = 1; break;
+    case 15: status.fire10 = 1; break;
+  }
+  return gamepad_buttons( &status);
+}
+
+static uint16_t settings_built_protocols( void){
+  uint16_t result = 0;
+#if defined( ENABLE_SNES)
+  result |= SETTINGS_PROTOCOL_SNES;
+#endif // ENABLE_SNES
+#if defined( ENABLE_ATARI_PADDLE)
+  result |= SETTINGS_PROTOCOL_ATARI_PADDLE;
+#endif // ENABLE_ATARI_PADDLE
+#if defined( ENABLE_SPINNER)
+  result |= SETTINGS_PROTOCOL_SPINNER;
+#endif // ENABLE_SPINNER
+#if defined( ENABLE_JOYBUS)
+  result |= SETTINGS_PROTOCOL_JOYBUS;
+#endif // ENABLE_JOYBUS
+#if defined( ENABLE_PSX)
+  result |= SETTINGS_PROTOCOL_PSX;
+#endif // ENABLE_PSX
+#if defined( ENABLE_GENESIS)
+  result |= SETTINGS_PROTOCOL_GENESIS;
+#endif // ENABLE_GENESIS
+  return result;
+}
+
+// The ones of the Configuration sections
+static void settings_default( usb_pad_encoder_settings_t* settings){
+  static const uint8_t switch_pin[ 16] = {
+    FULLSWITCH_UP_PIN, FULLSWITCH_DOWN_PIN, FULLSWITCH_LEFT_PIN, FULLSWITCH_RIGHT_PIN,
+    FULLSWITCH_SELECT_PIN, FULLSWITCH_COIN_PIN,
+    FULLSWITCH_FIRE_1_PIN, FULLSWITCH_FIRE_2_PIN, FULLSWITCH_FIRE_3_PIN,
+    FULLSWITCH_FIRE_4_PIN, FULLSWITCH_FIRE_5_PIN, FULLSWITCH_FIRE_6_PIN,
+    FULLSWITCH_FIRE_7_PIN, FULLSWITCH_FIRE_8_PIN, FULLSWITCH_FIRE_9_PIN,
+    FULLSWITCH_FIRE_10_PIN,
+  };
+  gamepad_status_t selector;
+  memset( &selector, 0, sizeof( selector));
+  selector.AUTOFIRE_SELECTOR = 1;
+
+  memset( settings, 0, sizeof( *settings));
+  settings->version = SETTINGS_VERSION;
+  settings->autofire_mode = AUTOFIRE_MODE;
+  settings->autofire_tap_count = AUTOFIRE_TAP_COUNT;
+  for( int k = 0; k < 16; k += 1)
+    if( switch_button( k) == gamepad_buttons( &selector)) settings->autofire_selector = k;
+  settings->protocols = settings_built_protocols();
+  settings->tap_max_period = TAP_MAX_PERIOD / 1000;
+  settings->autofire_period = AUTOFIRE_PERIOD / 1000;
+  memcpy( settings->switch_pin, switch_pin, sizeof( switch_pin));
+}
+
+// Full-switch indexes that are read by the enabled protocols
+static uint16_t settings_shared( uint16_t protocols){
+  uint16_t shared = 0;
+  if( protocols & SETTINGS_PROTOCOL_ATARI_PADDLE) shared |= SHARED_ATARI_PADDLE;
+  if( protocols & SETTINGS_PROTOCOL_SPINNER)      shared |= SHARED_SPINNER;
+  if( protocols & SETTINGS_PROTOCOL_SNES)         shared |= SHARED_SNES;
+  if( protocols & SETTINGS_PROTOCOL_JOYBUS)       shared |= SHARED_JOYBUS;
+  if( protocols & SETTINGS_PROTOCOL_PSX)          shared |= SHARED_PSX;
+  if( protocols & SETTINGS_PROTOCOL_GENESIS)      shared |= SHARED_GENESIS;
+  return shared;
+}
+
+static void pin_mark( uint8_t* used, uint8_t pin){
+  used[ pin >> 3] |= 1 << ( pin & 7);
+}
+
+static int pin_marked( const uint8_t* used, uint8_t pin){
+  return used[ pin >> 3] >> ( pin & 7) & 1;
+}
+
+// Marks the pins of the enabled protocols, that no switch can use
+static void settings_protocol_pins( uint16_t protocols, uint8_t* used){
+#if defined( ENABLE_ATARI_PADDLE)
+  // The fires are plain switches, read also as full-switch buttons
+  if( protocols & SETTINGS_PROTOCOL_ATARI_PADDLE){
+    pin_mark( used, ATARI_PADDLE_FIRST_ANGLE_PIN);
+    pin_mark( used, ATARI_PADDLE_SECOND_ANGLE_PIN);
+  }
+#endif // ENABLE_ATARI_PADDLE
+#if defined( ENABLE_SPINNER)
+  if( protocols & SETTINGS_PROTOCOL_SPINNER){
+    pin_mark( used, SPINNER_A_PIN);
+    pin_mark( used, SPINNER_B_PIN);
+  }
+#endif // ENABLE_SPINNER
+#if defined( ENABLE_SNES)
+  if( protocols & SETTINGS_PROTOCOL_SNES){
+    pin_mark( used, SNES_DATA_PIN);
+    pin_mark( used, SNES_LATCH_PIN);
+    pin_mark( used, SNES_CLOCK_PIN);
+  }
+#endif // ENABLE_SNES
+#if defined( ENABLE_JOYBUS)
+  if( protocols & SETTINGS_PROTOCOL_JOYBUS){
+    pin_mark( used, JOYBUS_DATA_PIN);
+  }
+#endif // ENABLE_JOYBUS
+#if defined( ENABLE_PSX)
+  if( protocols & SETTINGS_PROTOCOL_PSX){
+    pin_mark( used, PSX_COMMAND_PIN);
+    pin_mark( used, PSX_DATA_PIN);
+    pin_mark( used, PSX_CLOCK_PIN);
+    pin_mark( used, PSX_ACK_PIN);
+    pin_mark( used, PSX_ATTENTION_PIN);
+  }
+#endif // ENABLE_PSX
+#if defined( ENABLE_GENESIS)
+  if( protocols & SETTINGS_PROTOCOL_GENESIS){
+    pin_mark( used, GENESIS_UP_PIN);
+    pin_mark( used, GENESIS_DOWN_PIN);
+    pin_mark( used, GENESIS_LEFT_PIN);
+    pin_mark( used, GENESIS_RIGHT_PIN);
+    pin_mark( used, GENESIS_TL_PIN);
+    pin_mark( used, GENESIS_TR_PIN);
+    pin_mark( used, GENESIS_SELECT_PIN);
+  }
+#endif // ENABLE_GENESIS
+}
+
+// The pins come from the host, and they are used for direct port access, so
+// each one must exist, and it must not be used by an other switch or by an
+// enabled protocol
+static int settings_valid_pins( const usb_pad_encoder_settings_t* settings){
+  uint8_t used[ 32];
+  const uint16_t shared = settings_shared( settings->protocols);
+  memset( used, 0, sizeof( used));
+  settings_protocol_pins( settings->protocols, used);
+  for( int k = 0; k < 16; k += 1){
+    const uint8_t pin = settings->switch_pin[ k];
+    if( ( shared >> k & 1) || pin == SETTINGS_NO_PIN) continue;
+    if( pin >= PLATFORM_PIN_COUNT || pin_marked( used, pin)) return 0;
+    pin_mark( used, pin);
+  }
+  return 1;
+}
+
+static int settings_valid( const usb_pad_encoder_settings_t* settings){
+  return settings->version == SETTINGS_VERSION
+      && settings->autofire_mode >= NONE && settings->autofire_mode <= TOGGLE
+      && settings->autofire_tap_count > 0
+      && settings->autofire_selector < 16
+      && !( settings->protocols & ~settings_built_protocols())
+      && settings->tap_max_period > 0
+      && settings->autofire_period > 0
+      && settings_valid_pins( settings);
+}
+
+// A switch read equal to its accepted value does not change the state of its
+// debounce, so only the other ones are debounced; but the adaptive debounce
+// measures the bounce, so it needs all of them. All are debounced also at the
+// first step, when the debounce is initialized.
+static void read_switch_plan( usb_pad_encoder_t* ctx, gamepad_status_t* gamepad){
+  const plan_t* plan = &ctx->plan;
+#if defined( DEBOUNCE_ADAPTIVE)
+  const char all = 1;
+#else // DEBOUNCE_ADAPTIVE
+  const char all = !ctx->switch_primed;
+#endif // DEBOUNCE_ADAPTIVE
+  uint16_t buttons = ctx->switch_accepted;
+  for( uint8_t k = 0; k < plan->fullswitch_count; k += 1){
+    const switch_plan_t* entry = plan->fullswitch + k;
+    const int pressed = !read_digital( entry->pin);
+    if( !all && pressed == !!( buttons & entry->mask)) continue;
+    if( button_debounce( ctx, ctx->debounce_slot + entry->slot, pressed)) buttons |= entry->mask;
+    else buttons &= ~entry->mask;
+  }
+  ctx->switch_accepted = buttons;
+  ctx->switch_primed = 1;
+  gamepad_add_buttons( gamepad, buttons);
+}
+
+static void plan_add( stage_t* list, uint8_t* count, stage_t stage){
+  list[ *count] = stage;
+  *count += 1;
+}
+
+static void settings_compile( usb_pad_encoder_t* ctx){
+  const usb_pad_encoder_settings_t* settings = &ctx->settings;
+  const uint16_t protocols = settings->protocols;
+  plan_t* plan = &ctx->plan;
+  const uint16_t shared = settings_shared( protocols);
+
+  memset( plan, 0, sizeof( *plan));
+
+  // The read stages, in the order of the full build
+  plan_add( plan->read, &plan->read_count, read_switch_plan);
+  if( protocols & SETTINGS_PROTOCOL_ATARI_PADDLE){
+    plan_add( plan->read, &plan->read_count, read_atari_paddle);
+  }
+  if( protocols & SETTINGS_PROTOCOL_SPINNER){
+    plan_add( plan->read, &plan->read_count, read_spinner);
+  }
+  if( protocols & SETTINGS_PROTOCOL_SNES){
+    plan_add( plan->read, &plan->read_count, read_snes);
+  }
+  if( protocols & SETTINGS_PROTOCOL_JOYBUS){
+    plan_add( plan->read, &plan->read_count, read_joybus);
+  }
+  if( protocols & SETTINGS_PROTOCOL_PSX){
+    plan_add( plan->read, &plan->read_count, read_psx);
+  }
+  if( protocols & SETTINGS_PROTOCOL_GENESIS){
+    plan_add( plan->read, &plan->read_count, read_genesis);
+  }
+
+  for( int k = 0; k < 16; k += 1){
+    if( ( shared >> k & 1) || settings->switch_pin[ k] == SETTINGS_NO_PIN) continue;
+    switch_plan_t* entry = plan->fullswitch + plan->fullswitch_count;
+    entry->pin = settings->switch_pin[ k];
+    entry->slot = k;
+    entry->mask = switch_button( k);
+    plan->fullswitch_count += 1;
+  }
+
+  // The process stages, but the dpad one that is always there
+  switch( settings->autofire_mode){
+    case ASSIST: plan->autofire = autofire_assist; break;
+    case TOGGLE: plan->autofire = autofire_toggle; break;
+  }
+  if( plan->autofire) plan_add( plan->process, &plan->process_count, process_autofire);
+  if( protocols & SETTINGS_PROTOCOL_ATARI_PADDLE)
+    plan_add( plan->process, &plan->process_count, process_atari_axis);
+
+  plan->selector_mask = switch_button( settings->autofire_selector);
+  plan->autofire_tap_count = settings->autofire_tap_count;
+  plan->tap_max_period = settings->tap_max_period * 1000UL;
+  plan->autofire_period = settings->autofire_period * 1000UL;
+}
+
+// The interrupts of a protocol disabled at runtime would still change its
+// state, while its pins can be switches now
+static void pin_change_none( void){
+}
+
+static void settings_stop( uint16_t removed){
+#if defined( ENABLE_SPINNER)
+  if( removed & SETTINGS_PROTOCOL_SPINNER){
+    attach_pin_change( SPINNER_A_PIN, pin_change_none);
+    attach_pin_change( SPINNER_B_PIN, pin_change_none);
+    spinner_count = 0;
+  }
+#endif // ENABLE_SPINNER
+#if defined( ENABLE_PSX)
+  if( removed & SETTINGS_PROTOCOL_PSX){
+    attach_pin_change( PSX_ACK_PIN, pin_change_none);
+    psx_ack_edges = 0;
+  }
+#endif // ENABLE_PSX
+}
+
+// The pins of all the switches, and the protocols enabled since the previous
+// settings
+static void settings_setup( usb_pad_encoder_t* ctx, uint16_t previous){
+  const uint16_t added = ctx->settings.protocols & ~previous;
+  settings_stop( previous & ~ctx->settings.protocols);
+  for( uint8_t k = 0; k < ctx->plan.fullswitch_count; k += 1)
+    setup_input( ctx->plan.fullswitch[ k].pin, 1);
+  if( added & SETTINGS_PROTOCOL_ATARI_PADDLE) setup_atari_paddle( ctx);
+  if( added & SETTINGS_PROTOCOL_SPINNER) setup_spinner( ctx);
+  if( added & SETTINGS_PROTOCOL_SNES) setup_snes( ctx);
+  if( added & SETTINGS_PROTOCOL_JOYBUS) setup_joybus( ctx);
+  if( added & SETTINGS_PROTOCOL_PSX) setup_psx( ctx);
+  if( added & SETTINGS_PROTOCOL_GENESIS) setup_genesis( ctx);
+}
+
+static void settings_load( usb_pad_encoder_t* ctx){
+  storage_read( SETTINGS_STORAGE_ADDRESS, &ctx->settings, sizeof( ctx->settings));
+  if( settings_valid( &ctx->settings)) return;
+  settings_default( &ctx->settings);
+  LOG(1, "no valid settings saved, using the defaults");
+}
+
+// The ones received by the feature report
+static void settings_update( usb_pad_encoder_t* ctx){
+  const uint16_t previous = ctx->settings.protocols;
+  // They are set in the USB interrupt, that must not change them during the
+  // copy, or see the flag cleared before the copy is done
+  disable_interrupts();
+  ctx->settings = ctx->received;
+  ctx->settings_received = 0;
+  enable_interrupts();
+  settings_compile( ctx);
+  settings_setup( ctx, previous);
+  ctx->switch_accepted = 0;
+  ctx->switch_primed = 0;
+  storage_schedule( ctx, &ctx->settings_save, 0);
+  wake_now( ctx);
+  LOG(1, "settings changed: protocols %x autofire %d", ctx->settings.protocols, ctx->settings.autofire_mode);
+}
+
+static void settings_save( usb_pad_encoder_t* ctx){
+  if( storage_save( ctx, &ctx->settings_save, SETTINGS_STORAGE_ADDRESS, &ctx->settings, sizeof( ctx->settings)))
+    LOG(1, "settings saved");
+}
+
+int usb_pad_encoder_get_settings_context( usb_pad_encoder_t* ctx, uint8_t* report, int size){
+  if( size < (int) sizeof( ctx->settings)) return -1;
+  memcpy( report, &ctx->settings, sizeof( ctx->settings));
+  return sizeof( ctx->settings);
+}
+
+int usb_pad_encoder_set_settings_context( usb_pad_encoder_t* ctx, const uint8_t* report, int size){
+  usb_pad_encoder_settings_t settings;
+  if( ctx->settings_received || size != (int) sizeof( settings)) return -1;
+  memcpy( &settings, report, sizeof( settings));
+  if( !settings_valid( &settings)) return -1;
+  ctx->received = settings;
+  ctx->settings_received = 1;
+  return 0;
+}
+
+int usb_pad_encoder_get_settings( uint8_t* report, int size){
+  return usb_pad_encoder_get_settings_context( &default_context, report, size);
+}
+
+int usb_pad_encoder_set_settings( const uint8_t* report, int size){
+  return usb_pad_encoder_set_settings_context( &default_context, report, size);
+}
+
+#endif // RUNTIME_SETTINGS
+
 // dispatcher ---------------------------------------------------------------------
 
-void usb_pad_encoder_init(){
-  
+void usb_pad_encoder_init_context( usb_pad_encoder_t* ctx){
+
+  memset( ctx, 0, sizeof( *ctx));
   gamepad_init();
-  setup_fullswitch();
-  setup_atari_paddle();
-  setup_snes();
-  next_time_step();
+#if defined( RUNTIME_SETTINGS)
+  settings_load( ctx);
+  settings_compile( ctx);
+  settings_setup( ctx, 0);
+#else // RUNTIME_SETTINGS
+  setup_fullswitch( ctx);
+  setup_atari_paddle( ctx);
+  setup_spinner( ctx);
+  setup_snes( ctx);
+  setup_joybus( ctx);
+  setup_psx( ctx);
+  setup_genesis( ctx);
+#endif // RUNTIME_SETTINGS
+  next_time_step( ctx);
+  wake_now( ctx);
   config_log();
 }
 
-void usb_pad_encoder_step(){
-  static gamepad_status_t old_status = {0};
+void usb_pad_encoder_step_context( usb_pad_encoder_t* ctx){
+
+  next_time_step( ctx);
 
-  next_time_step();
+#if defined( RUNTIME_SETTINGS)
+  if( ctx->settings_received) settings_update( ctx);
+  const plan_t* plan = &ctx->plan;
+#endif // RUNTIME_SETTINGS
+
+  // The stages ask again for the wakes they still need, also the read ones
+  const int expired = wake_expired( ctx);
+  if( expired) ctx->wake_pending = 0;
 
   gamepad_status_t gamepad = {0};
   // memset( &gamepad, sizeof( gamepad), 0);
 
-  read_fullswitch( &gamepad);
-  read_atari_paddle( &gamepad);
-  read_snes( &gamepad);
-
-  process_autofire( &gamepad);
-  process_atari_axis( &gamepad);
+#if defined( RUNTIME_SETTINGS)
+  for( uint8_t k = 0; k < plan->read_count; k += 1) plan->read[ k]( ctx, &gamepad);
+#else // RUNTIME_SETTINGS
+  read_fullswitch( ctx, &gamepad);
+  read_atari_paddle( ctx, &gamepad);
+  read_spinner( ctx, &gamepad);
+  read_snes( ctx, &gamepad);
+  read_joybus( ctx, &gamepad);
+  read_psx( ctx, &gamepad);
+  read_genesis( ctx, &gamepad);
+#endif // RUNTIME_SETTINGS
+
+  // Fast path: nothing to do if the input did not change and no stage asked to
+  // be run again
+  int changed = memcmp( &ctx->old_input, &gamepad, sizeof( gamepad)) || gamepad_has_relative( &gamepad);
+  if( !changed && !expired && !FORCE_FULL_STEP)
+    return;
+  ctx->old_input = gamepad;
+
+  // The stages see an input change also in the next step (e.g. a tap counted
+  // with the new press time), so run them once more
+  if( changed) wake_now( ctx);
+
+#if defined( RUNTIME_SETTINGS)
+  for( uint8_t k = 0; k < plan->process_count; k += 1) plan->process[ k]( ctx, &gamepad);
+  settings_save( ctx);
+#else // RUNTIME_SETTINGS
+  process_autofire( ctx, &gamepad);
+  process_atari_axis( ctx, &gamepad);
+#endif // RUNTIME_SETTINGS
   process_dpad( &gamepad);
 
-  if (memcmp( &old_status, &gamepad, sizeof( gamepad)))
-    gamepad_send(&gamepad);
-  old_status = gamepad;
+  // Relative fields must be sent also when they are equal to the previous ones
+  if (memcmp( &ctx->old_status, &gamepad, sizeof( gamepad)) || gamepad_has_relative( &gamepad))
+    gamepad_send( ctx, &gamepad);
+  ctx->old_status = gamepad;
+}
+
+long usb_pad_encoder_wake_delay_context( usb_pad_encoder_t* ctx){
+  if( !ctx->wake_pending) return -1;
+  const long delay = (long)( ctx->wake_time - get_elasped_microsecond());
+  return delay > 0 ? delay : 0;
+}
+
+void usb_pad_encoder_init(){
+  usb_pad_encoder_init_context( &default_context);
+}
+
+void usb_pad_encoder_step(){
+  usb_pad_encoder_step_context( &default_context);
+}
+
+long usb_pad_encoder_wake_delay( void){
+  return usb_pad_encoder_wake_delay_context( &default_context);
 }
 
 // --------------------------------------------------------------------------------
@@ -10,6 +10,14 @@
 #error "Arduino board does not support PluggubleHID module"
 #endif
 
+#if defined( ENABLE_PSX)
+#include <SPI.h>
+#endif
+
+#if defined( ENABLE_ATARI_PADDLE) || defined( RUNTIME_SETTINGS)
+#include <avr/eeprom.h>
+#endif
+
 //#define DEBUG
 
 // for debug/logging only
@@ -51,8 +59,8 @@ static void delay_microsecond(unsigned long us){
 
 static void setup_input( uint8_t p, uint8_t d){
   switch(d){
-    case 0: pinMode( p, INPUT);
-    case 1: pinMode( p, INPUT_PULLUP);
+    case 0: pinMode( p, INPUT); break;
+    case 1: pinMode( p, INPUT_PULLUP); break;
   }
 }
 
@@ -60,8 +68,10 @@ static void setup_output( uint8_t p){
   pinMode( p, OUTPUT);
 }
 
+// Direct port access: digitalRead/digitalWrite take some us each, that is too
+// much for the Genesis pad read, where there are some tens of them in a row.
 static int read_digital( uint8_t p){
-  return digitalRead( p);
+  return !!( *portInputRegister( digitalPinToPort( p)) & digitalPinToBitMask( p));
 }
 
 static int read_analog( uint8_t p){
@@ -69,9 +79,186 @@ static int read_analog( uint8_t p){
 }
 
 static void write_digital( uint8_t p, uint8_t v){
-  return digitalWrite( p, v);
+  volatile uint8_t* out = portOutputRegister( digitalPinToPort( p));
+  uint8_t mask = digitalPinToBitMask( p);
+  uint8_t sreg = SREG;
+  cli();
+  if( v) *out |= mask;
+  else *out &= ~mask;
+  SREG = sreg;
+}
+
+static void (*pin_change_isr)(void) = 0;
+
+ISR(PCINT0_vect){
+  if( pin_change_isr) pin_change_isr();
+}
+
+static void attach_pin_change( uint8_t p, void (*isr)(void)){
+  if( digitalPinToInterrupt( p) != NOT_AN_INTERRUPT){
+    attachInterrupt( digitalPinToInterrupt( p), isr, CHANGE);
+  } else if( digitalPinToPCICR( p)){
+    // All the pin-change pins of the 32u4 share the PCINT0 vector
+    pin_change_isr = isr;
+    *digitalPinToPCMSK( p) |= _BV( digitalPinToPCMSKbit( p));
+    *digitalPinToPCICR( p) |= _BV( digitalPinToPCICRbit( p));
+  } else {
+    LOG(1, "pin %d can not generate interrupts", p);
+  }
+}
+
+static void disable_interrupts(void){
+  noInterrupts();
+}
+
+static void enable_interrupts(void){
+  interrupts();
+}
+
+#if defined( ENABLE_JOYBUS)
+// N64/GameCube transfer, cycle counted for the 16 MHz AVR: 16 cycles per us,
+// 64 per bit. The line is pulled low switching the pin to output (its PORT bit
+// is 0) and released switching it back to input. The interrupts are disabled
+// for the whole transfer (at most about 370 us).
+#if F_CPU != 16000000L
+#error joybus_transfer is cycle counted for a 16 MHz clock
+#endif
+
+// Busy loop of 3*N cycles (N > 0)
+#define JOYBUS_DELAY3( N) "ldi %[delay], " #N "\n 7: dec %[delay]\n brne 7b\n"
+
+static uint8_t joybus_transfer( uint8_t p, const uint8_t* request, uint8_t request_len, uint8_t* low_time, uint8_t max_bits){
+  if( request_len == 0 || max_bits == 0) return 0;
+  uint8_t port = digitalPinToPort( p);
+  uint8_t mask = digitalPinToBitMask( p);
+  volatile uint8_t* ddr = portModeRegister( port);
+  *portOutputRegister( port) &= ~mask;
+
+  uint8_t sreg = SREG;
+  cli();
+  uint8_t released = *ddr & ~mask;
+  uint8_t pulled = *ddr | mask;
+  uint8_t left = max_bits;
+  uint8_t byte, count, delay;
+  uint16_t timeout;
+
+  // The cycle count at the end of each instruction is noted as tNN, from the
+  // falling edge of the current bit (t0)
+  asm volatile(
+    // Request
+    "1:  ld   %[byte], X+              \n" // t61
+    "    ldi  %[count], 8              \n" // t62
+    "2:  st   Z, %[pulled]             \n" // t0
+    "    lsl  %[byte]                  \n" // t1
+    "    brcs 3f                       \n" // t2, t3 if taken
+    // bit 0: low until t48
+         JOYBUS_DELAY3( 14)                // t44
+    "    nop                           \n" // t45
+    "    nop                           \n" // t46
+    "    st   Z, %[released]           \n" // t48
+    "    rjmp 4f                       \n" // t50
+    // bit 1: low until t16
+    "3:                                \n"
+         JOYBUS_DELAY3( 3)                 // t12
+    "    nop                           \n" // t13
+    "    nop                           \n" // t14
+    "    st   Z, %[released]           \n" // t16
+         JOYBUS_DELAY3( 11)                // t49
+    "    nop                           \n" // t50
+    "4:  dec  %[count]                 \n" // t51
+    "    breq 5f                       \n" // t52, t53 if taken
+         JOYBUS_DELAY3( 2)                 // t58
+    "    nop                           \n" // t59
+    "    nop                           \n" // t60
+    "    rjmp 2b                       \n" // t62 -> next bit at t64 = t0
+    "5:  dec  %[len]                   \n" // t54
+    "    breq 6f                       \n" // t55, t56 if taken
+    "    nop                           \n" // t56
+    "    nop                           \n" // t57
+    "    rjmp 1b                       \n" // t59 -> ld, ldi, next bit at t0
+    // Stop bit (a 1)
+    "6:  nop                           \n" // t57
+    "    nop                           \n" // t58
+    "    nop                           \n" // t59
+    "    nop                           \n" // t60
+    "    nop                           \n" // t61
+    "    nop                           \n" // t62
+    "    st   Z, %[pulled]             \n" // t0
+         JOYBUS_DELAY3( 4)                 // t12
+    "    nop                           \n" // t13
+    "    nop                           \n" // t14
+    "    st   Z, %[released]           \n" // t16
+
+    // Answer: the PIN register is just before the DDR one; 8 cycles (0.5 us)
+    // per loop, so 2 counts per us
+    "    sbiw r30, 1                   \n"
+    "    movw r26, %[out]              \n"
+    "    ldi  %A[timeout], 64          \n" // 32 us for the first bit
+    "    ldi  %B[timeout], 0           \n"
+    "8:  ld   %[byte], Z               \n" // wait for the falling edge
+    "    and  %[byte], %[mask]         \n"
+    "    breq 9f                       \n"
+    "    sbiw %[timeout], 1            \n"
+    "    brne 8b                       \n"
+    "    rjmp 11f                      \n"
+    "9:  clr  %[count]                 \n"
+    "10: inc  %[count]                 \n" // measure the low time
+    "    breq 11f                      \n" // stuck low
+    "    ld   %[byte], Z               \n"
+    "    and  %[byte], %[mask]         \n"
+    "    nop                           \n"
+    "    breq 10b                      \n"
+    "    st   X+, %[count]             \n"
+    "    ldi  %A[timeout], 16          \n" // 8 us for the following ones
+    "    ldi  %B[timeout], 0           \n"
+    "    dec  %[left]                  \n"
+    "    brne 8b                       \n"
+    "11:                               \n"
+    : [byte] "=&r" ( byte), [count] "=&d" ( count), [delay] "=&d" ( delay),
+      [timeout] "=&w" ( timeout), [len] "+r" ( request_len), [left] "+r" ( left),
+      "+x" ( request), "+z" ( ddr)
+    : [pulled] "r" ( pulled), [released] "r" ( released), [mask] "r" ( mask),
+      [out] "r" ( low_time)
+    : "memory"
+  );
+
+  SREG = sreg;
+  return max_bits - left;
+}
+#undef JOYBUS_DELAY3
+#endif // ENABLE_JOYBUS
+
+#if defined( ENABLE_PSX)
+// Hardware SPI, driven through its registers so the transfer of a byte does
+// not wait
+static void spi_setup( unsigned long hz){
+  SPI.begin();
+  SPI.beginTransaction( SPISettings( hz, LSBFIRST, SPI_MODE3));
+  SPI.endTransaction();
+}
+
+static void spi_start( uint8_t data){
+  SPDR = data;
 }
 
+static int spi_result( void){
+  if( !( SPSR & _BV( SPIF))) return -1;
+  return SPDR;
+}
+#endif // ENABLE_PSX
+
+#if defined( ENABLE_ATARI_PADDLE) || defined( RUNTIME_SETTINGS)
+static void storage_read( uint16_t address, void* data, uint16_t size){
+  eeprom_read_block( data, (const void*) address, size);
+}
+
+// Only the changed bytes are written. The encoder writes a byte at a time, so
+// the write is just started: it waits only if the previous one is not ended.
+static void storage_write( uint16_t address, const void* data, uint16_t size){
+  eeprom_update_block( data, (void*) address, size);
+}
+#endif // ENABLE_ATARI_PADDLE || RUNTIME_SETTINGS
+
 static void use_hid_descriptor( uint8_t* desc, size_t len){
   static HIDSubDescriptor node( desc, len);
   HID().AppendDescriptor(&node);
@@ -81,6 +268,65 @@ static void send_hid_report( int id, void* data, size_t len){
   HID().SendReport( id, data, len);
 }
 
+#if defined( RUNTIME_SETTINGS) || defined( DEBOUNCE_ADAPTIVE)
+// The HID module of the core does not handle the feature reports, so the
+// settings and the bounce ones are served by a module without interfaces,
+// plugged before it: the HID module is created at its first use, in the setup,
+// and it gets the same interface number. The control requests reach the
+// modules in the plug order.
+#define HID_REPORT_TYPE_FEATURE 3
+
+class FeatureReports : public PluggableUSBModule {
+public:
+  FeatureReports() : PluggableUSBModule( 0, 0, 0) {
+    PluggableUSB().plug( this);
+  }
+
+protected:
+  bool setup( USBSetup& setup){
+    if( setup.wIndex != pluggedInterface || setup.wValueH != HID_REPORT_TYPE_FEATURE) return false;
+    const bool get = setup.bmRequestType == REQUEST_DEVICETOHOST_CLASS_INTERFACE && setup.bRequest == HID_GET_REPORT;
+    const bool set = setup.bmRequestType == REQUEST_HOSTTODEVICE_CLASS_INTERFACE && setup.bRequest == HID_SET_REPORT;
+#if defined( RUNTIME_SETTINGS)
+    if( setup.wValueL == SETTINGS_REPORT_ID){
+      uint8_t report[ 1 + sizeof( usb_pad_encoder_settings_t)];
+      report[ 0] = SETTINGS_REPORT_ID;
+      if( get){
+        usb_pad_encoder_get_settings( report + 1, sizeof( report) - 1);
+        USB_SendControl( 0, report, sizeof( report));
+        return true;
+      }
+      if( set){
+        if( setup.wLength != sizeof( report)) return false; // stall
+        USB_RecvControl( report, sizeof( report));
+        return usb_pad_encoder_set_settings( report + 1, sizeof( report) - 1) == 0;
+      }
+    }
+#endif // RUNTIME_SETTINGS
+#if defined( DEBOUNCE_ADAPTIVE)
+    if( setup.wValueL == BOUNCE_REPORT_ID && get){
+      uint8_t report[ 1 + BOUNCE_SWITCHES * sizeof( bounce_stat_t)];
+      report[ 0] = BOUNCE_REPORT_ID;
+      usb_pad_encoder_get_bounce_report( report + 1, sizeof( report) - 1);
+      USB_SendControl( 0, report, sizeof( report));
+      return true;
+    }
+#endif // DEBOUNCE_ADAPTIVE
+    return false;
+  }
+
+  int getInterface( uint8_t* count){
+    return 0;
+  }
+
+  int getDescriptor( USBSetup& setup){
+    return 0;
+  }
+};
+
+static FeatureReports feature_reports;
+#endif // RUNTIME_SETTINGS || DEBOUNCE_ADAPTIVE
+
 static void setup_first() {
 
 #ifdef USE_SERIAL
@@ -93,24 +339,45 @@ static void setup_last() {
 #ifdef LED_BUILTIN_TX
   // shutdown annoying leds
   pinMode(LED_BUILTIN, OUTPUT);
-  pinMode(LED_BUILTIN_RX, OUTPUT);
   pinMode(LED_BUILTIN_TX, OUTPUT);
   digitalWrite(LED_BUILTIN, HIGH);
-  digitalWrite(LED_BUILTIN_RX, HIGH);
   digitalWrite(LED_BUILTIN_TX, HIGH);
+#if !defined( ENABLE_PSX) // the RX led is the psx ATTENTION line
+  pinMode(LED_BUILTIN_RX, OUTPUT);
+  digitalWrite(LED_BUILTIN_RX, HIGH);
+#endif // ENABLE_PSX
 #endif // LED_BUILTIN_TX
 
   LOG(1, "Setup completed");
 }
 
+#if defined( USE_SERIAL) && defined( DEBOUNCE_ADAPTIVE)
+// Send 'b' on the serial to get the bounce statistics of all the switches
+static void bounce_report(void){
+  if( Serial.available() <= 0 || Serial.read() != 'b') return;
+  for( int k = 0; k < 18; k += 1){
+    bounce_stat_t stat;
+    if( !usb_pad_encoder_bounce_stat( k, &stat)) continue;
+    LOG(1, "switch %d: window/%u estimate/%u max/%u changes/%u bounced/%u glitches/%u",
+        k, stat.window, stat.estimate, stat.max_bounce, stat.changes, stat.bounced, stat.glitches);
+  }
+}
+#endif // USE_SERIAL && DEBOUNCE_ADAPTIVE
+
 static void loop_first(void){
 
 #ifdef LED_BUILTIN_TX
   // the bootloader continously turn on the annoying leds, shutdown
   digitalWrite(LED_BUILTIN, HIGH);
-  digitalWrite(LED_BUILTIN_RX, HIGH);
   digitalWrite(LED_BUILTIN_TX, HIGH);
+#if !defined( ENABLE_PSX)
+  digitalWrite(LED_BUILTIN_RX, HIGH);
+#endif // ENABLE_PSX
 #endif // LED_BUILTIN_TX
+
+#if defined( USE_SERIAL) && defined( DEBOUNCE_ADAPTIVE)
+  bounce_report();
+#endif // USE_SERIAL && DEBOUNCE_ADAPTIVE
 }
 
 void setup() {
@@ -128,6 +395,9 @@ void loop(){
 // needed by the HID library.
 #define HID_DESCRIPTOR_ATTRIBUTE PROGMEM
 
+// The pins that the host can set with RUNTIME_SETTINGS
+#define PLATFORM_PIN_COUNT NUM_DIGITAL_PINS
+
 #define INCLUDE_IMPLEMENTATION
 #include "usb_pad_encoder.h"
 